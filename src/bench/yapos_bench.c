@@ -0,0 +1,430 @@
+/** \file yapos_bench.c
+ ** \brief Kernel microbenchmarks
+ **
+ ** Built instead of the demo application (main.c) when YAPOS_BENCH is
+ ** defined. Every figure is reported as min/avg/max CPU cycles, measured
+ ** with the DWT cycle counter or, where it is not implemented (e.g. QEMU),
+ ** with SysTick. Results are printed over USART1 (PC4 TX, 115200 8N1) or,
+ ** with YAPOS_BENCH_SEMIHOSTING, to the debugger/QEMU semihosting console.
+ ** Define YAPOS_PENDSV_ARMV6M as well to measure the portable context
+ ** switch instead of the ARMv7-M one.
+ */
+
+#ifdef YAPOS_BENCH
+
+#include "stm32f30x_rcc.h"
+#include "stm32f30x_gpio.h"
+#include "stm32f30x_usart.h"
+#include "yapos.h"
+
+
+#define ERR_TRAP(err_code) \
+	do { \
+		if (err_code != YAPOS_ERR_OK) \
+			while(1); \
+	} while (0)
+
+/* Number of samples per measurement */
+#define BENCH_SAMPLES		256
+/* Tick period (cycles) */
+#define BENCH_TICK_CYCLES	(SystemCoreClock / 1000)
+/* Interrupt triggered by software for the ISR wakeup measurement */
+#define BENCH_IRQn		EXTI0_IRQn
+#define BENCH_IRQHandler	EXTI0_IRQHandler
+/* Message size (words) of the queue round trip */
+#define BENCH_MSG_WORDS		4
+/* Loop iterations longer than the fastest one times this factor are
+   counted as interrupted by the tick */
+#define BENCH_GAP_FACTOR	4
+
+/* Measurement statistics */
+struct bench_stat {
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+	uint32_t count;
+};
+
+/* Members */
+static bool use_cyccnt;
+static uint32_t tick_cycles;
+
+static struct bench_stat stat_tick;
+static struct bench_stat stat_rr;
+static struct bench_stat stat_wakeup;
+static struct bench_stat stat_isr;
+static struct bench_stat stat_notify;
+static struct bench_stat stat_pingpong;
+static struct bench_stat stat_queue;
+
+/* Round-robin phase: last time stamp and the task which took it */
+static volatile uint32_t rr_stamp;
+static volatile uint32_t rr_owner;
+/* Wakeup phase: time stamp continuously updated by the low priority task */
+static volatile uint32_t spin_stamp;
+/* ISR wakeup phase: set by the controller before blocking, the background
+   task time stamps and triggers the interrupt giving the semaphore */
+static volatile bool isr_armed;
+static volatile uint32_t isr_stamp;
+/* Task notified by the interrupt handler instead of giving sem_isr */
+static volatile yapos_task_t isr_task;
+
+static struct yapos_sem sem_isr;
+static struct yapos_sem sem_ping;
+static struct yapos_sem sem_pong;
+static struct yapos_queue queue_ping;
+static struct yapos_queue queue_pong;
+
+
+static void stat_reset(struct bench_stat *p_stat)
+{
+	p_stat->min = UINT32_MAX;
+	p_stat->max = 0;
+	p_stat->sum = 0;
+	p_stat->count = 0;
+}
+
+static void stat_add(struct bench_stat *p_stat, uint32_t sample)
+{
+	if (sample < p_stat->min)
+		p_stat->min = sample;
+	if (sample > p_stat->max)
+		p_stat->max = sample;
+	p_stat->sum += sample;
+	p_stat->count++;
+}
+
+/* Enable the DWT cycle counter if the core implements it */
+static void time_init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+
+	if (DWT->CTRL & DWT_CTRL_NOCYCCNT_Msk)
+		return;
+
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	__NOP();
+	__NOP();
+	use_cyccnt = (DWT->CYCCNT != 0);
+}
+
+/* Current time in cycles */
+static inline uint32_t time_now(void)
+{
+	if (use_cyccnt)
+		return DWT->CYCCNT;
+
+	/* SysTick fallback: ticks and the down-counter, read until consistent */
+	uint32_t ticks, val;
+	do {
+		ticks = yapos_get_ticks();
+		val = SysTick->VAL;
+	} while (ticks != yapos_get_ticks());
+
+	return ticks*tick_cycles + (tick_cycles-1-val);
+}
+
+#ifdef YAPOS_BENCH_SEMIHOSTING
+static void bench_puts(const char *str)
+{
+	/* SYS_WRITE0 */
+	register uint32_t r0 __asm("r0") = 0x04;
+	register const char *r1 __asm("r1") = str;
+
+	__asm volatile ("bkpt 0xab" : "+r"(r0) : "r"(r1) : "memory");
+}
+#else
+static void bench_puts(const char *str)
+{
+	while (*str) {
+		while (USART_GetFlagStatus(USART1, USART_FLAG_TXE) == RESET);
+		USART_SendData(USART1, *str++);
+	}
+}
+#endif
+
+static void bench_put_u32(uint32_t value, uint32_t width)
+{
+	char buf[11];
+	uint32_t i = sizeof(buf)-1;
+
+	buf[i] = '\0';
+	do {
+		buf[--i] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0 && i > 0);
+
+	while (sizeof(buf)-1-i < width && i > 0)
+		buf[--i] = ' ';
+
+	bench_puts(&buf[i]);
+}
+
+static void stat_print(const char *name, const struct bench_stat *p_stat)
+{
+	bench_puts(name);
+	if (p_stat->count == 0) {
+		bench_puts("       n/a\r\n");
+		return;
+	}
+	bench_puts(" min");
+	bench_put_u32(p_stat->min, 7);
+	bench_puts(" avg");
+	bench_put_u32(p_stat->sum / p_stat->count, 7);
+	bench_puts(" max");
+	bench_put_u32(p_stat->max, 7);
+	bench_puts("\r\n");
+}
+
+static void usart_init(void)
+{
+#ifndef YAPOS_BENCH_SEMIHOSTING
+	GPIO_InitTypeDef gpio;
+	USART_InitTypeDef usart;
+
+	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_GPIOC, ENABLE);
+	RCC_APB2PeriphClockCmd(RCC_APB2Periph_USART1, ENABLE);
+
+	GPIO_StructInit(&gpio);
+	gpio.GPIO_Pin = GPIO_Pin_4;
+	gpio.GPIO_Mode = GPIO_Mode_AF;
+	gpio.GPIO_OType = GPIO_OType_PP;
+	gpio.GPIO_PuPd = GPIO_PuPd_UP;
+	gpio.GPIO_Speed = GPIO_Speed_50MHz;
+	GPIO_Init(GPIOC, &gpio);
+	GPIO_PinAFConfig(GPIOC, GPIO_PinSource4, GPIO_AF_7);
+
+	USART_StructInit(&usart);
+	usart.USART_BaudRate = 115200;
+	usart.USART_Mode = USART_Mode_Tx;
+	USART_Init(USART1, &usart);
+	USART_Cmd(USART1, ENABLE);
+#endif
+}
+
+/* Round-robin pair at equal priority: every sample is the time between
+   the last time stamp of one task and the first one of the other, i.e. the
+   tick handler plus a full context switch */
+static void task_spin(void *p_params)
+{
+	uint32_t me = (uint32_t)p_params;
+
+	while (stat_rr.count < BENCH_SAMPLES) {
+		uint32_t now = time_now();
+		if (rr_owner != me) {
+			if (rr_owner != 0)
+				stat_add(&stat_rr, now-rr_stamp);
+			rr_owner = me;
+		}
+		rr_stamp = now;
+	}
+
+	/* The first task keeps running as the background of the wakeup
+	   measurement, the other one retires */
+	if (me == 1) {
+		while (1) {
+			if (isr_armed) {
+				isr_armed = false;
+				isr_stamp = time_now();
+				NVIC_SetPendingIRQ(BENCH_IRQn);
+			}
+			spin_stamp = time_now();
+		}
+	}
+
+	while (1)
+		yapos_sleep_ticks(UINT32_MAX);
+}
+
+/* Interrupt handler waking up the controller */
+void YAPOS_CCMFUNC BENCH_IRQHandler(void)
+{
+	if (isr_task != NULL)
+		yapos_notify_from_isr(isr_task, 1, YAPOS_NOTIFY_INCREMENT);
+	else
+		yapos_sem_give_from_isr(&sem_isr);
+}
+
+/* Ping-pong partner, below the controller: returns every token, then
+   every message, it gets */
+static void task_pong(void *p_params)
+{
+	(void)p_params;
+
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		yapos_sem_take(&sem_ping, YAPOS_WAIT_FOREVER);
+		yapos_sem_give(&sem_pong);
+	}
+
+	while (1) {
+		uint32_t msg[BENCH_MSG_WORDS];
+		yapos_queue_receive(&queue_ping, msg, YAPOS_WAIT_FOREVER);
+		yapos_queue_send(&queue_pong, msg, YAPOS_WAIT_FOREVER);
+	}
+}
+
+/* Controller, at the highest priority */
+static void task_bench(void *p_params)
+{
+	(void)p_params;
+
+	/* Tick overhead: the only running task sees the tick handler as a
+	   gap between consecutive time stamps (the tick does not trigger
+	   PendSV, there is no other task to switch to) */
+	uint32_t loop_min = UINT32_MAX;
+	uint32_t prev = time_now();
+	for (uint32_t i = 0; i < 1000; i++) {
+		uint32_t now = time_now();
+		if (now-prev < loop_min)
+			loop_min = now-prev;
+		prev = now;
+	}
+
+	prev = time_now();
+	while (stat_tick.count < BENCH_SAMPLES) {
+		uint32_t now = time_now();
+		if (now-prev > loop_min*BENCH_GAP_FACTOR)
+			stat_add(&stat_tick, now-prev-loop_min);
+		prev = now;
+	}
+
+	/* Tick + switch: let the round-robin pair run */
+	yapos_sleep_ticks(2*BENCH_SAMPLES+2);
+
+	/* Tick to task wakeup: the sleeping task preempts the background one
+	   on the tick its timeout expires */
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		yapos_sleep_ticks(1);
+		stat_add(&stat_wakeup, time_now()-spin_stamp);
+	}
+
+	/* Interrupt to task wakeup: the semaphore given by the interrupt
+	   handler is handed over to the blocked controller */
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		isr_armed = true;
+		yapos_sem_take(&sem_isr, YAPOS_WAIT_FOREVER);
+		stat_add(&stat_isr, time_now()-isr_stamp);
+	}
+
+	/* Same through a task notification */
+	isr_task = yapos_task_self();
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		isr_armed = true;
+		yapos_notify_wait(UINT32_MAX, NULL, YAPOS_WAIT_FOREVER);
+		stat_add(&stat_notify, time_now()-isr_stamp);
+	}
+
+	/* Semaphore round trip: give to the partner, which runs as soon as the
+	   controller blocks and gives back (two switches) */
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		uint32_t start = time_now();
+		yapos_sem_give(&sem_ping);
+		yapos_sem_take(&sem_pong, YAPOS_WAIT_FOREVER);
+		stat_add(&stat_pingpong, time_now()-start);
+	}
+
+	/* Queue round trip: the partner waits in receive, so the message is
+	   copied straight to its buffer, and back */
+	for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+		uint32_t msg[BENCH_MSG_WORDS] = { i };
+		uint32_t start = time_now();
+		yapos_queue_send(&queue_ping, msg, YAPOS_WAIT_FOREVER);
+		yapos_queue_receive(&queue_pong, msg, YAPOS_WAIT_FOREVER);
+		stat_add(&stat_queue, time_now()-start);
+	}
+
+	/* Derived PendSV switch cost */
+	struct bench_stat stat_switch;
+	stat_reset(&stat_switch);
+	if (stat_tick.count > 0 && stat_rr.count > 0) {
+		stat_switch.min = stat_rr.min - stat_tick.min;
+		stat_switch.max = stat_rr.max - stat_tick.min;
+		stat_switch.sum = stat_rr.sum - (uint64_t)stat_tick.min*stat_rr.count;
+		stat_switch.count = stat_rr.count;
+	}
+
+	bench_puts("\r\nyapos kernel benchmark (cycles, ");
+	bench_puts(use_cyccnt ? "DWT CYCCNT" : "SysTick");
+	bench_puts(")\r\n");
+	stat_print("tick overhead      ", &stat_tick);
+	stat_print("tick + switch      ", &stat_rr);
+	stat_print("PendSV switch      ", &stat_switch);
+	stat_print("tick to task wakeup", &stat_wakeup);
+	stat_print("ISR to task wakeup ", &stat_isr);
+	stat_print("ISR notify wakeup  ", &stat_notify);
+	stat_print("sem ping-pong      ", &stat_pingpong);
+	stat_print("queue ping-pong    ", &stat_queue);
+
+	/* Tick handler cost as accounted by the kernel, and how many ticks
+	   actually triggered PendSV */
+	struct yapos_tick_stats tick;
+	if (yapos_get_tick_stats(&tick) == YAPOS_ERR_OK && tick.count > 0) {
+		bench_puts("tick handler        avg");
+		bench_put_u32(tick.cycles / tick.count, 7);
+		bench_puts(" PendSV");
+		bench_put_u32(tick.pendsv, 7);
+		bench_puts(" /");
+		bench_put_u32(tick.count, 7);
+		bench_puts(" ticks\r\n");
+	}
+	bench_puts("done\r\n");
+
+	while (1)
+		yapos_sleep_ticks(UINT32_MAX);
+}
+
+int main(void)
+{
+	yapos_err_t err_code;
+
+	static uint32_t stack_bench[256];
+	static uint32_t stack_spin1[128];
+	static uint32_t stack_spin2[128];
+	static uint32_t stack_pong[128];
+	static uint32_t queue_ping_buf[BENCH_MSG_WORDS];
+	static uint32_t queue_pong_buf[BENCH_MSG_WORDS];
+
+	usart_init();
+	time_init();
+
+	stat_reset(&stat_tick);
+	stat_reset(&stat_rr);
+	stat_reset(&stat_wakeup);
+	stat_reset(&stat_isr);
+	stat_reset(&stat_notify);
+	stat_reset(&stat_pingpong);
+	stat_reset(&stat_queue);
+
+	yapos_sem_init(&sem_isr, 0, 1);
+	yapos_sem_init(&sem_ping, 0, 1);
+	yapos_sem_init(&sem_pong, 0, 1);
+	yapos_queue_init(&queue_ping, queue_ping_buf, sizeof(queue_ping_buf), 1);
+	yapos_queue_init(&queue_pong, queue_pong_buf, sizeof(queue_pong_buf), 1);
+#ifdef YAPOS_CONF_MAX_SYSCALL_PRIO
+	/* The handler calls the kernel */
+	NVIC_SetPriority(BENCH_IRQn, YAPOS_CONF_MAX_SYSCALL_PRIO);
+#endif
+	NVIC_EnableIRQ(BENCH_IRQn);
+
+	err_code = yapos_init();
+	ERR_TRAP(err_code);
+
+	err_code = yapos_add_task_ex(&task_bench, NULL, stack_bench, 256, 3);
+	ERR_TRAP(err_code);
+	err_code = yapos_add_task_ex(&task_spin, (void *)1, stack_spin1, 128, 1);
+	ERR_TRAP(err_code);
+	err_code = yapos_add_task_ex(&task_spin, (void *)2, stack_spin2, 128, 1);
+	ERR_TRAP(err_code);
+	err_code = yapos_add_task_ex(&task_pong, NULL, stack_pong, 128, 2);
+	ERR_TRAP(err_code);
+
+	tick_cycles = BENCH_TICK_CYCLES;
+	err_code = yapos_start(tick_cycles);
+	ERR_TRAP(err_code);
+
+	/* The program should never reach there: */
+	while (1);
+}
+
+#endif
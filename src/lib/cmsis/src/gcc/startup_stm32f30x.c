@@ -21,6 +21,9 @@ extern unsigned int _sdata;         /* Start address of .data section */
 extern unsigned int _edata;         /* End address of .data section */
 extern unsigned int __bss_start__;  /* Start address of the .bss section */
 extern unsigned int __bss_end__;    /* End address of the .bss section */
+extern unsigned int _siccmfunc;     /* Start address of the image of the .ccmfunc section */
+extern unsigned int _sccmfunc;      /* Start address of .ccmfunc section (CCM SRAM) */
+extern unsigned int _eccmfunc;      /* End address of .ccmfunc section (CCM SRAM) */
 extern unsigned int _estack;        /* Stack pointer reset address */
 
 extern void (*__preinit_array_start[])(void) __attribute__((weak));
@@ -120,6 +123,9 @@ void __attribute__ ((section(".after_vectors"),noreturn)) _start(void)
     */
     __initialize_data(&_sidata, &_sdata, &_edata);
 
+    /* Copy the code executed from CCM SRAM from Flash */
+    __initialize_data(&_siccmfunc, &_sccmfunc, &_eccmfunc);
+
     /* Set-Up base hardware */
     __initialize_hardware();
 
@@ -8,6 +8,8 @@
  **     $LastChangedBy: Stefano.Rossi $
  */
 
+#ifndef YAPOS_BENCH
+
 #include "stm32f30x_rcc.h"
 #include "stm32f30x_gpio.h"
 #include "yapos.h"
@@ -20,45 +22,49 @@
 	} while (0)
 
 
-static void delay(volatile uint32_t time)
-{
-	while (time > 0)
-		time--;
-}
-
 static void task_blue(void *p_params)
 {
+	bool on = false;
+
 	while (1) {
-		__disable_irq();
-		GPIOE->ODR ^= GPIO_Pin_8;
-		__enable_irq();
+		/* BSRR/BRR writes, atomic without masking interrupts */
+		on = !on;
+		GPIO_WriteBit(GPIOE, GPIO_Pin_8, on ? Bit_SET : Bit_RESET);
 
-		delay(0x100000);
+		yapos_sleep_ticks(250);
 	}
 }
 
 static void task_red(void *p_params)
 {
+	bool on = false;
+
 	while (1) {
-		__disable_irq();
-		GPIOE->ODR ^= GPIO_Pin_9;
-		__enable_irq();
+		on = !on;
+		GPIO_WriteBit(GPIOE, GPIO_Pin_9, on ? Bit_SET : Bit_RESET);
 
-		delay(0x200000);
+		yapos_sleep_ticks(500);
 	}
 }
 
 static void task_orange(void *p_params)
 {
+	uint32_t last_wake = yapos_get_ticks();
+	bool on = false;
+
 	while (1) {
-		__disable_irq();
-		GPIOE->ODR ^= GPIO_Pin_10;
-		__enable_irq();
+		on = !on;
+		GPIO_WriteBit(GPIOE, GPIO_Pin_10, on ? Bit_SET : Bit_RESET);
 
-		delay(0x100000);
+		yapos_sleep_until(&last_wake, 250);
 	}
 }
 
+/* Tasks created by yapos_init(): */
+YAPOS_TASK_DEFINE(blue, task_blue, YAPOS_PRIO_DEFAULT, 128);
+YAPOS_TASK_DEFINE(red, task_red, YAPOS_PRIO_DEFAULT, 128);
+YAPOS_TASK_DEFINE(orange, task_orange, YAPOS_PRIO_DEFAULT, 128);
+
 int main(void)
 {
 	yapos_err_t err_code;
@@ -81,25 +87,15 @@ int main(void)
 	gpio.GPIO_Pin= GPIO_Pin_10;
 	GPIO_Init(GPIOE, &gpio);
 
-	/* Initialize task stacks: */
-	static uint32_t stack1[128];
-	static uint32_t stack2[128];
-	static uint32_t stack3[128];
-
 	err_code = yapos_init();
 	ERR_TRAP(err_code);
 
-	err_code = yapos_add_task(&task_blue, NULL, stack1, 128);
-	ERR_TRAP(err_code);
-	err_code = yapos_add_task(&task_red, NULL, stack2, 128);
-	ERR_TRAP(err_code);
-	err_code = yapos_add_task(&task_orange, NULL, stack3, 128);
-	ERR_TRAP(err_code);
-
-	/* Context switch every second: */
-	err_code = yapos_start(0x8ffffUL);
+	/* Tick every millisecond: */
+	err_code = yapos_start(SystemCoreClock / 1000);
 	ERR_TRAP(err_code);
 
 	/* The program should never reach there: */
 	while (1);
 }
+
+#endif
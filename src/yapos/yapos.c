@@ -1,4 +1,168 @@
 #include "yapos.h"
+#include "yapos_port.h"
+
+/* Initial task context: the exception frame stacked by the hardware plus
+   the registers saved by PendSV_Handler (see yapos_pendsv.S) */
+#define CTX_HW_WORDS	8
+#ifdef YAPOS_PORT_FPU
+/* Hard-float build: EXC_RETURN is saved as well, it tells whether the task
+   has an FP context (S16-S31, saved only for tasks using the FPU) */
+#define CTX_SW_WORDS	9
+#else
+#define CTX_SW_WORDS	8
+#endif
+#define CTX_WORDS	(CTX_HW_WORDS+CTX_SW_WORDS)
+/* Registers saved by PendSV_Handler for tasks with an FP context */
+#ifdef YAPOS_PORT_FPU
+#define CTX_SW_MAX_WORDS	(CTX_SW_WORDS+16)
+#else
+#define CTX_SW_MAX_WORDS	CTX_SW_WORDS
+#endif
+
+#ifdef YAPOS_CONF_MPU
+#ifndef YAPOS_PORT_ARMV7M
+#error "YAPOS_CONF_MPU requires the ARMv7-M port"
+#endif
+
+/* MPU regions: the code space is shared by all tasks, the task regions are
+   reprogrammed by PendSV_Handler on every switch (on overlap the higher
+   region number wins) */
+#define MPU_REGION_CODE		0
+#define MPU_REGION_CCM		1
+#define MPU_REGION_SHARED	2
+#define MPU_REGION_TASK		4	/* First of the 4 task regions */
+#define MPU_REGION_STACK	4
+#define MPU_REGION_DATA		5
+#define MPU_REGION_PERIPH	6
+#define MPU_REGION_GUARD	7
+
+/* Code space (0x00000000-0x1FFFFFFF): flash, system memory, CCM SRAM */
+#define MPU_CODE_SIZE		0x20000000UL
+/* CCM SRAM (the largest of the STM32F30x), taken back from the code
+   region: kernel only, the task regions placed in it override it */
+#define MPU_CCM_SIZE		0x4000UL
+/* Stack guard, the smallest MPU region */
+#define MPU_GUARD_SIZE		32
+/* Kernel data readable by tasks (see KERNEL_SHARED) */
+#define MPU_SHARED_SIZE		32
+
+/* Region attributes (RASR without size and enable) */
+#define MPU_ATTR_CODE	((6UL << MPU_RASR_AP_Pos) | MPU_RASR_C_Msk)
+/* Privileged read/write (and execute, for YAPOS_CONF_CCMFUNC), no
+   unprivileged access */
+#define MPU_ATTR_CCM	((1UL << MPU_RASR_AP_Pos) | MPU_RASR_C_Msk | \
+			 MPU_RASR_S_Msk)
+#define MPU_ATTR_DATA	((3UL << MPU_RASR_AP_Pos) | MPU_RASR_XN_Msk | \
+			 MPU_RASR_C_Msk | MPU_RASR_S_Msk)
+#define MPU_ATTR_SHARED	((2UL << MPU_RASR_AP_Pos) | MPU_RASR_XN_Msk | \
+			 MPU_RASR_C_Msk | MPU_RASR_S_Msk)
+#define MPU_ATTR_DEVICE	((3UL << MPU_RASR_AP_Pos) | MPU_RASR_XN_Msk | \
+			 MPU_RASR_B_Msk | MPU_RASR_S_Msk)
+/* Guard: no unprivileged access, so task code and the exception frame
+   stacked on its behalf fault; the kernel can still read the canary */
+#define MPU_ATTR_GUARD	((1UL << MPU_RASR_AP_Pos) | MPU_RASR_XN_Msk)
+
+#if (YAPOS_CONF_IDLE_STACK_SIZE & (YAPOS_CONF_IDLE_STACK_SIZE-1)) != 0
+#error "YAPOS_CONF_IDLE_STACK_SIZE must be a power of two with YAPOS_CONF_MPU"
+#endif
+#define IDLE_STACK_ALIGN	__attribute__((aligned(YAPOS_CONF_IDLE_STACK_SIZE*4)))
+/* Start of the read-only region granted to all tasks, which holds the
+   current task pointer (for the mutex fast path) */
+#define KERNEL_SHARED	__attribute__((aligned(MPU_SHARED_SIZE)))
+#else
+#define IDLE_STACK_ALIGN
+#define KERNEL_SHARED
+#endif
+
+/* Kernel data accessed on every switch, in CCM SRAM with YAPOS_CONF_CCM
+   (not initialised by the startup code, see yapos_init()). With
+   YAPOS_CONF_MPU, CCM SRAM is kernel only (MPU_REGION_CCM) but for the
+   task regions and the KERNEL_SHARED one. */
+#ifdef YAPOS_CONF_CCM
+#define KERNEL_CCM	__attribute__((section(".yapos_ccm")))
+#else
+#define KERNEL_CCM
+#endif
+
+/* Kernel switch path, executed from CCM SRAM with YAPOS_CONF_CCMFUNC */
+#ifdef YAPOS_CONF_CCMFUNC
+#define KERNEL_CCMFUNC	__attribute__((section(".ccmfunc")))
+#else
+#define KERNEL_CCMFUNC
+#endif
+
+#if defined(YAPOS_CONF_CCMFUNC_LOCK) && !defined(YAPOS_CONF_CCMFUNC)
+#error "YAPOS_CONF_CCMFUNC_LOCK requires YAPOS_CONF_CCMFUNC"
+#endif
+
+/* Write protection granularity of CCM SRAM (SYSCFG_RCR) */
+#define CCM_PAGE_SIZE	1024UL
+
+#ifdef YAPOS_CONF_IRQ_VECTORS
+/* Vector table in RAM: the system exception vectors followed by the device
+   interrupt ones, aligned to its size rounded up to a power of two (VTOR) */
+#define VECTORS_COUNT	(16 + YAPOS_CONF_IRQ_VECTORS)
+#if VECTORS_COUNT <= 32
+#define VECTORS_ALIGN	128
+#elif VECTORS_COUNT <= 64
+#define VECTORS_ALIGN	256
+#elif VECTORS_COUNT <= 128
+#define VECTORS_ALIGN	512
+#elif VECTORS_COUNT <= 256
+#define VECTORS_ALIGN	1024
+#else
+#error "YAPOS_CONF_IRQ_VECTORS is out of range"
+#endif
+#endif
+
+#ifdef YAPOS_CONF_MAX_SYSCALL_PRIO
+/* SVCall gets the priority level above it */
+#if YAPOS_CONF_MAX_SYSCALL_PRIO < 1 || \
+		YAPOS_CONF_MAX_SYSCALL_PRIO >= (1 << __NVIC_PRIO_BITS)
+#error "YAPOS_CONF_MAX_SYSCALL_PRIO is out of range"
+#endif
+#ifdef YAPOS_PORT_BASEPRI
+/* BASEPRI value masking the interrupts allowed to call the kernel */
+#define KERNEL_BASEPRI \
+	(YAPOS_CONF_MAX_SYSCALL_PRIO << (8 - __NVIC_PRIO_BITS))
+#endif
+#endif
+
+#if YAPOS_CONF_PENDSV_PRIO < YAPOS_CONF_SYSTICK_PRIO
+#error "YAPOS_CONF_PENDSV_PRIO must be the lowest priority"
+#endif
+#if defined(YAPOS_CONF_MAX_SYSCALL_PRIO) && \
+		YAPOS_CONF_SYSTICK_PRIO < YAPOS_CONF_MAX_SYSCALL_PRIO
+#error "YAPOS_CONF_SYSTICK_PRIO is above YAPOS_CONF_MAX_SYSCALL_PRIO"
+#endif
+
+/* Debug assertion: stops the system */
+#ifdef YAPOS_CONF_DEBUG
+#define KERNEL_ASSERT(cond) \
+	do { \
+		if (!(cond)) \
+			while (1); \
+	} while (0)
+#else
+#define KERNEL_ASSERT(cond)	((void)0)
+#endif
+
+/* Mutex owner flag: tasks are waiting for the mutex, which is then in the
+   list of mutexes held by the owner */
+#define MUTEX_WAITERS	0x1UL
+
+/* Pattern filling unused stack, the lowest word is the overflow canary */
+#define STACK_FILL	0xA5A5A5A5UL
+
+/* EXC_RETURN - Thread mode with PSP, no FP frame */
+#define CTX_EXC_RETURN	0xFFFFFFFD
+
+/* Task states */
+enum {
+	TASK_FREE = 0,		/* Slot of the tasks table not in use */
+	TASK_ACTIVE,		/* Ready, running, sleeping or waiting */
+	TASK_EXITED,		/* Exited, until deleted */
+};
 
 /* Task descriptor */
 struct task {
@@ -7,139 +171,2857 @@ struct task {
 	   to locate it safely from assembly implementation of PendSV_Handler).
 	   The compiler might add padding between other structure elements. */
 	volatile uint32_t sp;
+#ifdef YAPOS_CONF_MPU
+	/* RBAR/RASR pairs of the task regions, written as they are by
+	   PendSV_Handler to the RBAR/RASR alias registers (it expects them at
+	   offset 4) */
+	uint32_t mpu[8];
+#endif
 	void (*handler)(void *params);
 	void *params;
+	uint8_t state;
+	/* Value passed to yapos_task_exit(), and the tasks joining the task */
+	void *retval;
+	struct yapos_wait join_wait;
+	/* Neighbours in the ready list of the task's priority level */
+	struct task *next;
+	struct task *prev;
+	/* Time slice and ticks left of it since the task was dispatched */
+	uint32_t slice;
+	uint32_t slice_left;
+	/* Next task in the timeout list, ticks left after the previous one and
+	   the pointer linking the task (NULL when not in the list) */
+	struct task *tnext;
+	uint32_t tdelta;
+	struct task **tlink;
+	/* Wait queue the task is blocked on (NULL if none), next task in it and
+	   the stacked R0 of the task, receiving the result of the wait */
+	struct yapos_wait *wait;
+	struct task *wnext;
+	uint32_t *wait_ret;
+	/* Message to be sent, or buffer to receive into, while waiting on a
+	   queue (the message itself in pointer mode) */
+	void *wait_msg;
+	/* Flags and options (YAPOS_EVENT_*) waited for on an event group, or
+	   flags to clear when a notification is received */
+	uint32_t wait_flags;
+	uint8_t wait_opts;
+	/* Notification word, whether it was notified since last received, and
+	   the wait queue of the task itself (it is the only one waiting) */
+	uint32_t notify_value;
+	bool notify_pending;
+	struct yapos_wait notify_wait;
+	/* Effective priority, raised above the base one while holding a mutex
+	   some higher priority task waits for */
+	uint8_t prio;
+	uint8_t base_prio;
+	/* Mutexes held with waiters, and the mutex the task waits for */
+	struct yapos_mutex *held;
+	struct yapos_mutex *wait_mutex;
+	/* Number of mutexes owned (nested locks not counted), kept by the
+	   fast paths as well: never below the actual number */
+	uint32_t mutexes;
+#ifdef YAPOS_CONF_STACK_CHECK
+	/* Lowest address of the stack, holding the canary */
+	uint32_t *stack;
+#endif
+#ifdef YAPOS_CONF_TASK_STATS
+	/* Cycles spent running (wraps), value at the start of the current
+	   statistics window and cycles run in the last complete window */
+	uint32_t cycles;
+	uint32_t window_start;
+	uint32_t window_cycles;
+	/* Number of times the task was switched out, by cause */
+	uint32_t switches[YAPOS_SWITCH_CAUSES];
+#endif
 };
 
-/* Tasks table */
+/* Tasks table (size is the number of slots ever used, deleted tasks leave
+   free slots behind for reuse) */
 struct tasks_table {
 	struct task tasks[YAPOS_CONF_MAX_TASKS];
-	volatile uint32_t current_task;
 	uint32_t size;
 };
 
+/* Ready queue: one circular list per priority level (the head is the next
+   task to be dispatched at that level) and a bitmap of non-empty levels
+   (bit N set means that level N has at least one ready task) */
+struct ready_queue {
+	struct task *lists[YAPOS_CONF_PRIO_LEVELS];
+	uint32_t bitmap;
+};
+
+/* Supervisor calls (SVC numbers, indexes in svc_table) */
+#define YAPOS_SVC_SLEEP			0
+#define YAPOS_SVC_SLEEP_UNTIL		1
+#define YAPOS_SVC_GET_TICKS		2
+#define YAPOS_SVC_GET_TASK_STATS	3
+#define YAPOS_SVC_IRQ_LOCK		4
+#define YAPOS_SVC_IRQ_UNLOCK		5
+#define YAPOS_SVC_IRQ_ENABLE		6
+#define YAPOS_SVC_IRQ_DISABLE		7
+#define YAPOS_SVC_SEM_TAKE		8
+#define YAPOS_SVC_SEM_GIVE		9
+#define YAPOS_SVC_MUTEX_LOCK		10
+#define YAPOS_SVC_MUTEX_UNLOCK		11
+#define YAPOS_SVC_QUEUE_SEND		12
+#define YAPOS_SVC_QUEUE_RECEIVE		13
+#define YAPOS_SVC_EVENT_SET		14
+#define YAPOS_SVC_EVENT_WAIT		15
+#define YAPOS_SVC_NOTIFY		16
+#define YAPOS_SVC_NOTIFY_WAIT		17
+#define YAPOS_SVC_YIELD			18
+#define YAPOS_SVC_TASK_CREATE		19
+#define YAPOS_SVC_TASK_EXIT		20
+#define YAPOS_SVC_TASK_JOIN		21
+#define YAPOS_SVC_TASK_DELETE		22
+#define YAPOS_SVC_IRQ_ATTACH		23
+#define YAPOS_SVC_GET_TICK_STATS	24
+#define YAPOS_SVC_EVENT_CLEAR		25
+#define YAPOS_SVC_EVENT_GET		26
+#define YAPOS_SVC_COUNT			27
+
+#define SVC_STR(s)	#s
+#define SVC_XSTR(s)	SVC_STR(s)
+
+/* Supervisor call from a task: up to 3 arguments in R0-R2, the value
+   returned by the service in R0 */
+#define SVC_CALL(num, a0, a1, a2) ({ \
+	register uint32_t r0 __asm("r0") = (uint32_t)(a0); \
+	register uint32_t r1 __asm("r1") = (uint32_t)(a1); \
+	register uint32_t r2 __asm("r2") = (uint32_t)(a2); \
+	__asm volatile ("svc %3" : "+r"(r0) : "r"(r1), "r"(r2), "i"(num) \
+			: "memory"); \
+	r0; })
+
+/* Supervisor call with 4 arguments in R0-R3 */
+#define SVC_CALL4(num, a0, a1, a2, a3) ({ \
+	register uint32_t r0 __asm("r0") = (uint32_t)(a0); \
+	register uint32_t r1 __asm("r1") = (uint32_t)(a1); \
+	register uint32_t r2 __asm("r2") = (uint32_t)(a2); \
+	register uint32_t r3 __asm("r3") = (uint32_t)(a3); \
+	__asm volatile ("svc %4" : "+r"(r0) : "r"(r1), "r"(r2), "r"(r3), \
+			"i"(num) : "memory"); \
+	r0; })
+
+/* Deferred kernel work run by PendSV_Handler (see yapos_deferred_run()) */
+#define DEFERRED_EVENTS	0x1UL
+/* Deferred kernel work: select the next task (requested by an interrupt) */
+#define DEFERRED_SCHEDULE	0x2UL
+/* Deferred kernel work: round-robin at the end of a tick */
+#define DEFERRED_TICK	0x4UL
+
+/* Supervisor call service: receives R0-R3 of the calling task, the return
+   value is written to its stacked R0 */
+typedef uint32_t (*svc_func_t)(uint32_t a0, uint32_t a1, uint32_t a2,
+		uint32_t a3);
+#define SVC_FUNC(name) \
+	static uint32_t name(uint32_t a0 __attribute__((unused)), \
+			uint32_t a1 __attribute__((unused)), \
+			uint32_t a2 __attribute__((unused)), \
+			uint32_t a3 __attribute__((unused)))
+
 /* Members */
-static struct tasks_table tasks_tab;
-volatile struct task *yapos_curr_task;
-volatile struct task *yapos_next_task;
+static struct tasks_table tasks_tab KERNEL_CCM;
+static struct ready_queue ready_q KERNEL_CCM;
+volatile struct task *yapos_curr_task KERNEL_SHARED KERNEL_CCM;
+volatile struct task *yapos_next_task KERNEL_CCM;
 static bool init = false;
 
-/* Function called when some task handler unexpectedly returns */
+/* Kernel time */
+static volatile uint32_t ticks;
+static uint32_t tick_period;
+
+/* Timeout list sorted by expiry: every element stores its delay relative
+   to the previous one, so only the head needs updating on a tick */
+static struct task *timeout_head;
+
+/* Table of the tasks defined by YAPOS_TASK_DEFINE(), delimited by the
+   linker script (weak: no table without the symbols) */
+extern const struct yapos_task_def __yapos_tasks_start[] __attribute__((weak));
+extern const struct yapos_task_def __yapos_tasks_end[] __attribute__((weak));
+
+#ifdef YAPOS_CONF_CCMFUNC_LOCK
+/* Code copied to CCM SRAM (linker/sections.ld) */
+extern uint32_t _sccmfunc[];
+extern uint32_t _eccmfunc[];
+#endif
+
+/* Idle task, always ready at the lowest priority level */
+static struct task idle_task KERNEL_CCM;
+static uint32_t idle_stack[YAPOS_CONF_IDLE_STACK_SIZE] IDLE_STACK_ALIGN
+		KERNEL_CCM;
+
+#ifdef YAPOS_CONF_IRQ_VECTORS
+/* Vector table patched by yapos_irq_attach() */
+static uint32_t vectors[VECTORS_COUNT] __attribute__((aligned(VECTORS_ALIGN)))
+		KERNEL_CCM;
+#endif
+
+/* Deferred kernel work pending (DEFERRED_*), tested by PendSV_Handler */
+volatile uint32_t yapos_deferred;
+/* Event groups set since the last deferred run, with waiters to match */
+static struct yapos_event *event_pending;
+
+#ifdef YAPOS_CONF_TASK_STATS
+/* Ticks on which the running task kept the CPU, within its time slice,
+   although peers were ready (a switch each with one tick slices) */
+static volatile uint32_t avoided_switches;
+/* Cost of the tick */
+static struct yapos_tick_stats tick_stats;
+/* Task being charged for the cycles elapsed since stats_stamp */
+static struct task *stats_task;
+static uint32_t stats_stamp;
+/* Ticks elapsed in the current statistics window, cycles of the last
+   complete window */
+static uint32_t stats_window_ticks;
+static uint32_t stats_window_cycles;
+#endif
+
+#ifdef YAPOS_CONF_TICKLESS
+/* Number of tick periods spanned by the running (stretched) SysTick period,
+   0 when SysTick runs at its regular period */
+static uint32_t tickless_span;
+static volatile uint32_t suppressed_ticks;
+#endif
+
+/* Function called when some task handler returns: the task exits */
 static void task_finished(void)
 {
-	volatile uint32_t i = 0;
-	while (1)
-		i++;
+	yapos_task_exit(NULL);
 }
 
-/* Init scheduler */
-yapos_err_t yapos_init(void)
+#ifdef YAPOS_CONF_STACK_CHECK
+/* Called in handler mode when a task overflowed its stack (the canary was
+   overwritten or there is no room left to save its context). Override to
+   log or reset, the default one stops the system. */
+__attribute__((weak)) void yapos_stack_overflow_hook(
+		void (*handler)(void *params), void *params)
 {
-	/* Must be called once */
-	if (init)
-		return YAPOS_ERR_WRONG_STATE;
-	init = true;
+	(void)handler;
+	(void)params;
 
-	memset(&tasks_tab, 0, sizeof(tasks_tab));
+	while (1);
+}
 
-	return YAPOS_ERR_OK;
+/* Check the stack of a task being switched out */
+static void stack_check(struct task *p_task)
+{
+	if (*p_task->stack != STACK_FILL ||
+			__get_PSP() - CTX_SW_MAX_WORDS*4 <= (uint32_t)p_task->stack)
+		yapos_stack_overflow_hook(p_task->handler, p_task->params);
 }
+#endif
 
-/* Register new task */
-yapos_err_t yapos_add_task(void (*handler)(void *params), void *params,
-		uint32_t *stack, size_t stack_size)
+#ifdef YAPOS_CONF_MPU
+/* Check that region size is a power of two of at least 32 bytes and that
+   region base is aligned to it */
+static bool mpu_region_valid(const void *base, uint32_t size)
 {
-	/* Must be already initialized */
-	if (!init)
-		return YAPOS_ERR_WRONG_STATE;
+	return size >= 32 && (size & (size-1)) == 0 &&
+			((uint32_t)base & (size-1)) == 0;
+}
 
-	if (tasks_tab.size >= YAPOS_CONF_MAX_TASKS-1)
-		return YAPOS_ERR_NO_MEM;
+/* Encode region as RBAR/RASR pair, size 0 disables it */
+static void mpu_region_set(uint32_t *p_regs, uint32_t region,
+		const void *base, uint32_t size, uint32_t attr)
+{
+	p_regs[0] = (uint32_t)base | MPU_RBAR_VALID_Msk | region;
+	p_regs[1] = size == 0 ? 0 : attr | MPU_RASR_ENABLE_Msk |
+			((30UL - __CLZ(size)) << MPU_RASR_SIZE_Pos);
+}
 
-	/* Initialize the task structure and set SP to the top of the stack
-	   minus 16 words (64 bytes) to leave space for storing 16 registers */
-	struct task *p_task = &tasks_tab.tasks[tasks_tab.size];
-	p_task->handler = handler;
-	p_task->params = params;
-	p_task->sp = (uint32_t)(stack+stack_size-16);
+/* Prepare task regions: stack with its guard, private data and peripheral
+   window (the last two optional) */
+static void mpu_task_setup(struct task *p_task, uint32_t *stack,
+		size_t stack_size, const struct yapos_task_mpu *p_mpu)
+{
+	mpu_region_set(&p_task->mpu[0], MPU_REGION_STACK, stack,
+			stack_size*4, MPU_ATTR_DATA);
+	mpu_region_set(&p_task->mpu[6], MPU_REGION_GUARD, stack,
+			MPU_GUARD_SIZE, MPU_ATTR_GUARD);
 
-	/* Save init. values of registers which will be restored on exc. return:
-	   - XPSR: Default value (0x01000000)
-	   - PC: Point to the handler function
-	   - LR: Point to a function to be called when the handler returns
-	   - R0: Point to the handler function's parameter */
-	stack[stack_size-1] = 0x01000000;
-	stack[stack_size-2] = (uint32_t)handler;
-	stack[stack_size-3] = (uint32_t)&task_finished;
-	stack[stack_size-8] = (uint32_t)params;
+	if (p_mpu != NULL) {
+		mpu_region_set(&p_task->mpu[2], MPU_REGION_DATA,
+				p_mpu->data.base, p_mpu->data.size, MPU_ATTR_DATA);
+		mpu_region_set(&p_task->mpu[4], MPU_REGION_PERIPH,
+				p_mpu->periph.base, p_mpu->periph.size, MPU_ATTR_DEVICE);
+	} else {
+		mpu_region_set(&p_task->mpu[2], MPU_REGION_DATA, NULL, 0, 0);
+		mpu_region_set(&p_task->mpu[4], MPU_REGION_PERIPH, NULL, 0, 0);
+	}
+}
 
-#ifdef YAPOS_CONF_DEBUG
-	uint32_t base = (tasks_tab.size+1)*1000;
-	stack[stack_size-4] = base+12;  /* R12 */
-	stack[stack_size-5] = base+3;   /* R3  */
-	stack[stack_size-6] = base+2;   /* R2  */
-	stack[stack_size-7] = base+1;   /* R1  */
-	/* p_stack[stack_size-8] is R0 */
-	stack[stack_size-9] = base+7;   /* R7  */
-	stack[stack_size-10] = base+6;  /* R6  */
-	stack[stack_size-11] = base+5;  /* R5  */
-	stack[stack_size-12] = base+4;  /* R4  */
-	stack[stack_size-13] = base+11; /* R11 */
-	stack[stack_size-14] = base+10; /* R10 */
-	stack[stack_size-15] = base+9;  /* R9  */
-	stack[stack_size-16] = base+8;  /* R8  */
+/* Check whether the buffer is inside the task region of RBAR/RASR pair
+   p_regs */
+static bool mpu_region_contains(const uint32_t *p_regs, uint32_t start,
+		uint32_t size)
+{
+	if ((p_regs[1] & MPU_RASR_ENABLE_Msk) == 0)
+		return false;
+
+	uint32_t base = p_regs[0] & MPU_RBAR_ADDR_Msk;
+	uint32_t region_size = 2UL << ((p_regs[1] & MPU_RASR_SIZE_Msk) >>
+			MPU_RASR_SIZE_Pos);
+
+	return start >= base && start - base <= region_size &&
+			size <= region_size - (start - base);
+}
+
+/* Check that a buffer written by a supervisor call on behalf of the task
+   is one the task may write itself: in its stack (above the guard) or its
+   data region. Services run privileged, they would otherwise write
+   anywhere for unprivileged tasks. */
+static bool mpu_buf_valid(const struct task *p_task, const void *buf,
+		size_t size)
+{
+	/* Privileged tasks have the default memory map anyway */
+	if ((__get_CONTROL() & 0x1) == 0)
+		return true;
+
+	uint32_t start = (uint32_t)buf;
+	uint32_t guard_end = (p_task->mpu[0] & MPU_RBAR_ADDR_Msk) +
+			MPU_GUARD_SIZE;
+
+	return (mpu_region_contains(&p_task->mpu[0], start, size) &&
+			start >= guard_end) ||
+		mpu_region_contains(&p_task->mpu[2], start, size);
+}
+
+/* Program the shared regions and the regions of the first task, enable
+   the MPU (the kernel keeps the default memory map) */
+static void mpu_start(const struct task *p_task)
+{
+	MPU->CTRL = 0;
+
+	for (uint32_t region = 0; region < MPU_REGION_TASK; region++) {
+		uint32_t regs[2];
+		if (region == MPU_REGION_CODE)
+			mpu_region_set(regs, region, NULL, MPU_CODE_SIZE, MPU_ATTR_CODE);
+		else if (region == MPU_REGION_CCM)
+			mpu_region_set(regs, region, (void *)CCMDATARAM_BASE,
+					MPU_CCM_SIZE, MPU_ATTR_CCM);
+		else if (region == MPU_REGION_SHARED)
+			mpu_region_set(regs, region, (void *)&yapos_curr_task,
+					MPU_SHARED_SIZE, MPU_ATTR_SHARED);
+		else
+			mpu_region_set(regs, region, NULL, 0, 0);
+		MPU->RBAR = regs[0];
+		MPU->RASR = regs[1];
+	}
+
+	for (uint32_t i = 0; i < 8; i += 2) {
+		MPU->RBAR = p_task->mpu[i];
+		MPU->RASR = p_task->mpu[i+1];
+	}
+
+	MPU->CTRL = MPU_CTRL_PRIVDEFENA_Msk | MPU_CTRL_ENABLE_Msk;
+	SCB->SHCSR |= SCB_SHCSR_MEMFAULTENA_Msk;
+	__DSB();
+	__ISB();
+}
 #endif
 
-	tasks_tab.size++;
+/* Check whether running privileged (handler or privileged thread mode) */
+static bool is_privileged(void)
+{
+	return __get_IPSR() != 0 || (__get_CONTROL() & 0x1) == 0;
+}
+
+/* Check that a task handle designates the idle task or a slot of the
+   tasks table (whatever its state) */
+static bool task_valid(const struct task *p_task)
+{
+	uint32_t offset = (uint32_t)p_task - (uint32_t)tasks_tab.tasks;
 
-	return YAPOS_ERR_OK;
+	return p_task == &idle_task ||
+			(offset < tasks_tab.size*sizeof(struct task) &&
+			 offset % sizeof(struct task) == 0);
 }
 
-/* Start scheduler */
-yapos_err_t yapos_start(uint32_t systick_ticks)
+/* Check that a kernel object (or buffer) passed by a supervisor call is
+   reachable by the calling task, which the kernel then writes on its
+   behalf (see mpu_buf_valid()) */
+static bool task_obj_valid(const void *p_obj, size_t size)
 {
-	/* Must be already initialized */
-	if (!init)
-		return YAPOS_ERR_WRONG_STATE;
+#ifdef YAPOS_CONF_MPU
+	return mpu_buf_valid((struct task *)yapos_curr_task, p_obj, size);
+#else
+	(void)size;
+	return p_obj != NULL;
+#endif
+}
 
-	/* Lowest possible priority */
-	NVIC_SetPriority(PendSV_IRQn, 0xff);
-	/* Highest possible priority */
-	NVIC_SetPriority(SysTick_IRQn, 0x00);
+#ifdef YAPOS_CONF_MAX_SYSCALL_PRIO
+/* Check that the running interrupt handler, if any, may call the kernel */
+static bool isr_prio_valid(void)
+{
+	int32_t irqn = (int32_t)__get_IPSR() - 16;
 
-	/* Start the SysTick timer */
-	uint32_t ret_val = SysTick_Config(systick_ticks);
-	if (ret_val != 0)
+	return irqn < 0 ||
+		NVIC_GetPriority((IRQn_Type)irqn) >= YAPOS_CONF_MAX_SYSCALL_PRIO;
+}
+#endif
+
+/* Enter a kernel critical section, masking the interrupts allowed to call
+   the kernel (all of them without BASEPRI), and return the previous state.
+   Privileged code only. */
+static inline uint32_t kernel_lock(void)
+{
+#ifdef YAPOS_CONF_MAX_SYSCALL_PRIO
+	KERNEL_ASSERT(isr_prio_valid());
+#endif
+#ifdef KERNEL_BASEPRI
+	uint32_t state = __get_BASEPRI();
+	/* BASEPRI_MAX only raises the masking level */
+	__ASM volatile ("msr basepri_max, %0" : : "r" (KERNEL_BASEPRI) :
+			"memory");
+#else
+	uint32_t state = __get_PRIMASK();
+	__disable_irq();
+#endif
+
+	return state;
+}
+
+/* Leave a kernel critical section, restoring the state of kernel_lock() */
+static inline void kernel_unlock(uint32_t state)
+{
+#ifdef KERNEL_BASEPRI
+	__set_BASEPRI(state);
+#else
+	__set_PRIMASK(state);
+#endif
+}
+
+/* Append task to the tail of the ready list of its priority level */
+static void KERNEL_CCMFUNC ready_insert(struct task *p_task)
+{
+	struct task *p_head = ready_q.lists[p_task->prio];
+
+	if (p_head == NULL) {
+		p_task->next = p_task;
+		p_task->prev = p_task;
+		ready_q.lists[p_task->prio] = p_task;
+		ready_q.bitmap |= 1UL << p_task->prio;
+	} else {
+		/* The tail is the element just before the head */
+		p_task->next = p_head;
+		p_task->prev = p_head->prev;
+		p_head->prev->next = p_task;
+		p_head->prev = p_task;
+	}
+}
+
+/* Remove task from the ready list of its priority level */
+static void KERNEL_CCMFUNC ready_remove(struct task *p_task)
+{
+	if (p_task->next == p_task) {
+		ready_q.lists[p_task->prio] = NULL;
+		ready_q.bitmap &= ~(1UL << p_task->prio);
+	} else {
+		p_task->prev->next = p_task->next;
+		p_task->next->prev = p_task->prev;
+		if (ready_q.lists[p_task->prio] == p_task)
+			ready_q.lists[p_task->prio] = p_task->next;
+	}
+}
+
+/* Return the head of the highest priority non-empty ready list. The bitmap
+   is resolved by a single CLZ, so the cost does not depend on the number
+   of tasks or priority levels. */
+static KERNEL_CCMFUNC struct task *ready_highest(void)
+{
+	return ready_q.lists[31 - __CLZ(ready_q.bitmap)];
+}
+
+/* Queue task on a wait queue behind the waiters of the same or higher
+   priority */
+static void wait_insert(struct yapos_wait *p_wait, struct task *p_task)
+{
+	struct task *p_prev = NULL;
+	struct task *p_next = p_wait->head;
+
+	while (p_next != NULL && p_next->prio >= p_task->prio) {
+		p_prev = p_next;
+		p_next = p_next->wnext;
+	}
+
+	p_task->wnext = p_next;
+	if (p_prev == NULL)
+		p_wait->head = p_task;
+	else
+		p_prev->wnext = p_task;
+	p_task->wait = p_wait;
+}
+
+/* Remove task from the wait queue it is blocked on (its wait timed out) */
+static void wait_remove(struct task *p_task)
+{
+	struct yapos_wait *p_wait = p_task->wait;
+	struct task *p_prev = NULL;
+	struct task *p_next = p_wait->head;
+
+	while (p_next != p_task) {
+		p_prev = p_next;
+		p_next = p_next->wnext;
+	}
+
+	if (p_prev == NULL)
+		p_wait->head = p_task->wnext;
+	else
+		p_prev->wnext = p_task->wnext;
+	p_task->wait = NULL;
+}
+
+/* Check whether task is ready (running or in the ready list) */
+static bool task_is_ready(const struct task *p_task)
+{
+	return p_task->state == TASK_ACTIVE && p_task->wait == NULL &&
+			p_task->tlink == NULL;
+}
+
+/* Change the effective priority of a task, keeping ordered the ready list
+   or the wait queue it is in */
+static void task_set_prio(struct task *p_task, uint8_t prio)
+{
+	if (p_task->wait != NULL) {
+		struct yapos_wait *p_wait = p_task->wait;
+		wait_remove(p_task);
+		p_task->prio = prio;
+		wait_insert(p_wait, p_task);
+	} else if (task_is_ready(p_task)) {
+		ready_remove(p_task);
+		p_task->prio = prio;
+		ready_insert(p_task);
+	} else {
+		/* Sleeping */
+		p_task->prio = prio;
+	}
+}
+
+static struct task *mutex_owner(const struct yapos_mutex *p_mutex)
+{
+	return (struct task *)(p_mutex->owner & ~MUTEX_WAITERS);
+}
+
+static void mutex_held_add(struct task *p_task, struct yapos_mutex *p_mutex)
+{
+	p_mutex->next = p_task->held;
+	p_task->held = p_mutex;
+}
+
+static void mutex_held_remove(struct task *p_task,
+		struct yapos_mutex *p_mutex)
+{
+	struct yapos_mutex **pp_next = &p_task->held;
+
+	while (*pp_next != p_mutex)
+		pp_next = &(*pp_next)->next;
+	*pp_next = p_mutex->next;
+}
+
+/* Recompute the effective priority of a task: its base priority raised to
+   the one of the highest priority waiter of the mutexes it holds. When the
+   task is itself waiting for a mutex, the change is propagated along the
+   chain of owners. */
+static void mutex_prio_update(struct task *p_task)
+{
+	while (p_task != NULL) {
+		uint8_t prio = p_task->base_prio;
+		for (struct yapos_mutex *p_mutex = p_task->held; p_mutex != NULL;
+				p_mutex = p_mutex->next) {
+			struct task *p_waiter = p_mutex->wait.head;
+			if (p_waiter->prio > prio)
+				prio = p_waiter->prio;
+		}
+
+		if (prio == p_task->prio)
+			break;
+		task_set_prio(p_task, prio);
+
+		p_task = p_task->wait_mutex != NULL ?
+				mutex_owner(p_task->wait_mutex) : NULL;
+	}
+}
+
+/* A task stopped waiting for a mutex without getting it (timeout): the
+   owner may lose the priority it inherited from it */
+static void mutex_wait_abort(struct task *p_task)
+{
+	struct yapos_mutex *p_mutex = p_task->wait_mutex;
+	struct task *p_owner = mutex_owner(p_mutex);
+
+	p_task->wait_mutex = NULL;
+	if (p_mutex->wait.head == NULL) {
+		p_mutex->owner = (uint32_t)p_owner;
+		mutex_held_remove(p_owner, p_mutex);
+	}
+	mutex_prio_update(p_owner);
+}
+
+/* Park task on the timeout list, to be made ready after the given number
+   of ticks. Tasks expiring at the same tick are kept in FIFO order. */
+static void timeout_insert(struct task *p_task, uint32_t delay)
+{
+	struct task **pp_next = &timeout_head;
+
+	while (*pp_next != NULL && (*pp_next)->tdelta <= delay) {
+		delay -= (*pp_next)->tdelta;
+		pp_next = &(*pp_next)->tnext;
+	}
+
+	p_task->tdelta = delay;
+	p_task->tnext = *pp_next;
+	p_task->tlink = pp_next;
+	if (*pp_next != NULL) {
+		(*pp_next)->tdelta -= delay;
+		(*pp_next)->tlink = &p_task->tnext;
+	}
+	*pp_next = p_task;
+}
+
+/* Remove task from the timeout list before its timeout expired */
+static void timeout_remove(struct task *p_task)
+{
+	struct task *p_next = p_task->tnext;
+
+	*p_task->tlink = p_next;
+	if (p_next != NULL) {
+		p_next->tdelta += p_task->tdelta;
+		p_next->tlink = p_task->tlink;
+	}
+	p_task->tlink = NULL;
+}
+
+/* Advance the timeout list by the given number of ticks and make ready
+   every task whose timeout expired (a task blocked on a wait queue leaves
+   it, the result of its wait stays YAPOS_ERR_TIMEOUT) */
+static bool KERNEL_CCMFUNC timeout_advance(uint32_t elapsed)
+{
+	bool woken = false;
+
+	while (timeout_head != NULL && timeout_head->tdelta <= elapsed) {
+		struct task *p_task = timeout_head;
+		elapsed -= p_task->tdelta;
+		timeout_head = p_task->tnext;
+		if (timeout_head != NULL)
+			timeout_head->tlink = &timeout_head;
+		p_task->tlink = NULL;
+		if (p_task->wait != NULL)
+			wait_remove(p_task);
+		if (p_task->wait_mutex != NULL)
+			mutex_wait_abort(p_task);
+		ready_insert(p_task);
+		woken = true;
+	}
+
+	if (timeout_head != NULL)
+		timeout_head->tdelta -= elapsed;
+
+	return woken;
+}
+
+#ifdef YAPOS_CONF_TICKLESS
+/* Stretch the SysTick period, which has just started, up to the nearest
+   pending timeout (or as far as the 24-bit reload value allows) */
+static void tickless_enter(void)
+{
+	/* Already stretched (the idle task was selected again) */
+	if (tickless_span != 0)
+		return;
+
+	uint32_t span = (SysTick_LOAD_RELOAD_Msk+1) / tick_period;
+	if (timeout_head != NULL && timeout_head->tdelta < span)
+		span = timeout_head->tdelta;
+
+	/* Not worth it for a single tick */
+	if (span < 2)
+		return;
+
+	SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
+
+	/* The current period expired meanwhile: stretching it now would lose
+	   that tick, SysTick_Handler accounts for it first */
+	if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+		SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+		return;
+	}
+
+	/* Cycles already elapsed in the current period are subtracted from the
+	   stretched one. Writing VAL forces a reload of the counter from LOAD. */
+	uint32_t elapsed = SysTick->LOAD - SysTick->VAL;
+	SysTick->LOAD = span*tick_period - 1 - elapsed;
+	SysTick->VAL = 0;
+	SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+
+	tickless_span = span;
+}
+
+/* Restore the regular SysTick period after a stretched (or shortened, see
+   tickless_abort()) one expired and return the number of ticks it
+   accounted for */
+static uint32_t tickless_exit(void)
+{
+	uint32_t span = tickless_span;
+	if (span == 0)
+		return 1;
+	tickless_span = 0;
+
+	/* The counter has already reloaded the stretched value, restart it
+	   with the regular one (the handler entry latency is lost) */
+	SysTick->LOAD = tick_period - 1;
+	SysTick->VAL = 0;
+
+	suppressed_ticks += span - 1;
+
+	return span;
+}
+#endif
+
+#ifdef YAPOS_CONF_TASK_STATS
+/* Charge the cycles elapsed since the last sample to the running task */
+static void stats_sample(void)
+{
+	uint32_t now = DWT->CYCCNT;
+	stats_task->cycles += now - stats_stamp;
+	stats_stamp = now;
+}
+
+/* Close the statistics window of a single task */
+static uint32_t stats_window_task(struct task *p_task)
+{
+	p_task->window_cycles = p_task->cycles - p_task->window_start;
+	p_task->window_start = p_task->cycles;
+
+	return p_task->window_cycles;
+}
+
+/* Close the statistics window of all tasks (a tumbling window: the next
+   one starts from zero) */
+static void stats_window_close(void)
+{
+	stats_sample();
+
+	uint32_t busy = 0;
+	for (uint32_t i = 0; i < tasks_tab.size; i++)
+		if (tasks_tab.tasks[i].state != TASK_FREE)
+			busy += stats_window_task(&tasks_tab.tasks[i]);
+
+	/* The cycle counter stops while the idle task sleeps in WFI (for whole
+	   ticks with YAPOS_CONF_TICKLESS): the idle task gets the rest of the
+	   window as measured by the tick */
+	uint32_t idle = stats_window_task(&idle_task);
+	uint32_t wall = stats_window_ticks * tick_period;
+	if (wall > busy + idle) {
+		idle_task.cycles += wall - busy - idle;
+		idle_task.window_start = idle_task.cycles;
+		idle_task.window_cycles = wall - busy;
+	}
+
+	stats_window_cycles = busy + idle_task.window_cycles;
+	stats_window_ticks = 0;
+}
+
+/* Fill the statistics of a single task */
+static void stats_get(const struct task *p_task,
+		struct yapos_task_stats *p_stats)
+{
+	p_stats->handler = p_task->handler;
+	p_stats->prio = p_task->prio;
+	p_stats->cycles = p_task->cycles;
+	p_stats->cpu_percent = stats_window_cycles == 0 ? 0 :
+		(uint8_t)((uint64_t)p_task->window_cycles*100 / stats_window_cycles);
+	memcpy(p_stats->switches, p_task->switches, sizeof(p_stats->switches));
+}
+#endif
+
+/* Get run time statistics of the tasks (in tasks table order, count is
+   the capacity of the array on input and the number of tasks on output)
+   and of the idle task. Percentages refer to the last complete window of
+   YAPOS_CONF_STATS_WINDOW ticks (tumbling windows, not a sliding one). */
+static yapos_err_t task_stats_get(struct yapos_task_stats *p_stats,
+		size_t *p_count, struct yapos_task_stats *p_idle)
+{
+#ifdef YAPOS_CONF_TASK_STATS
+	if (p_count == NULL || (p_stats == NULL && *p_count > 0))
 		return YAPOS_ERR_INVALID_PARAM;
 
-	/* Start the first task */
-	yapos_curr_task = &tasks_tab.tasks[tasks_tab.current_task];
+	size_t count = 0;
+	for (uint32_t i = 0; i < tasks_tab.size && count < *p_count; i++)
+		if (tasks_tab.tasks[i].state != TASK_FREE)
+			stats_get(&tasks_tab.tasks[i], &p_stats[count++]);
+	*p_count = count;
 
-	/* Set PSP to the top of task's stack */
-	__set_PSP(yapos_curr_task->sp + 64);
-	/* Switch to Unprivileged Thread Mode with PSP */
-	__set_CONTROL(0x03);
-	/* Execute ISB after changing CONTORL (recommended) */
-	__ISB();
+	if (p_idle != NULL)
+		stats_get(&idle_task, p_idle);
 
-	/* Call first task handler */
-	yapos_curr_task->handler(yapos_curr_task->params);
+	return YAPOS_ERR_OK;
+#else
+	(void)p_stats;
+	(void)p_count;
+	(void)p_idle;
+	return YAPOS_ERR_WRONG_STATE;
+#endif
+}
+
+/* Copy the tick cost statistics */
+static yapos_err_t tick_stats_get(struct yapos_tick_stats *p_stats)
+{
+#ifdef YAPOS_CONF_TASK_STATS
+	if (p_stats == NULL)
+		return YAPOS_ERR_INVALID_PARAM;
+
+	uint32_t state = kernel_lock();
+	*p_stats = tick_stats;
+	kernel_unlock(state);
 
 	return YAPOS_ERR_OK;
+#else
+	(void)p_stats;
+	return YAPOS_ERR_WRONG_STATE;
+#endif
 }
 
-/* Systick interrupt handler */
-void SysTick_Handler(void)
+/* Advance kernel time and wake up tasks whose timeout expired, tell
+   whether any was */
+static bool KERNEL_CCMFUNC tick_advance(uint32_t elapsed)
 {
-	yapos_curr_task = &tasks_tab.tasks[tasks_tab.current_task];
+	ticks += elapsed;
+	bool woken = timeout_advance(elapsed);
 
-	/* Select next task */
-	tasks_tab.current_task++;
-	if (tasks_tab.current_task >= tasks_tab.size)
-		tasks_tab.current_task = 0;
+#ifdef YAPOS_CONF_TASK_STATS
+	stats_window_ticks += elapsed;
+	if (stats_window_ticks >= YAPOS_CONF_STATS_WINDOW)
+		stats_window_close();
+#endif
 
-	yapos_next_task = &tasks_tab.tasks[tasks_tab.current_task];
+	return woken;
+}
+
+#ifdef YAPOS_CONF_TICKLESS
+/* A task was made ready by an interrupt while ticks were suppressed:
+   account the ticks elapsed so far in the stretched period and shorten it
+   to the end of the current tick */
+static void tickless_abort(void)
+{
+	SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
+
+	/* The stretched period expired meanwhile, SysTick_Handler accounts
+	   for it */
+	if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+		SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+		return;
+	}
+
+	uint32_t elapsed = SysTick->LOAD - SysTick->VAL;
+	uint32_t left = tick_period - elapsed % tick_period;
+	SysTick->LOAD = left > 1 ? left - 1 : 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+
+	tickless_span = 1;
+	suppressed_ticks += elapsed / tick_period;
+	tick_advance(elapsed / tick_period);
+}
+#endif
+
+/* Select the next task and trigger PendSV which performs the actual
+   context switch. The cause tells why the running task would be left. */
+static void KERNEL_CCMFUNC schedule(yapos_switch_cause_t cause)
+{
+	/* Interrupt handlers leave the decision to PendSV_Handler: they may
+	   have preempted it in the middle of a switch (supervisor calls
+	   cannot, they are made by tasks) */
+	uint32_t exception = __get_IPSR();
+	if (exception != 0 && exception != SVCall_IRQn+16 &&
+			exception != PendSV_IRQn+16) {
+		yapos_deferred |= DEFERRED_SCHEDULE;
+		SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+		return;
+	}
+
+#ifdef YAPOS_CONF_COOPERATIVE
+	/* No preemption: the running task keeps the CPU while it is ready,
+	   the idle task excepted */
+	if (cause == YAPOS_SWITCH_PREEMPTED && yapos_curr_task != &idle_task &&
+			task_is_ready((struct task *)yapos_curr_task))
+		return;
+#endif
+
+	yapos_next_task = ready_highest();
+
+	bool dispatch = yapos_next_task != yapos_curr_task;
+	if (dispatch) {
+		/* A full time slice for the dispatched task */
+		yapos_next_task->slice_left = yapos_next_task->slice;
+#ifdef YAPOS_CONF_STACK_CHECK
+		stack_check((struct task *)yapos_curr_task);
+#endif
+	}
+
+#ifdef YAPOS_CONF_TASK_STATS
+	/* The switch is accounted when decided, PendSV tail-chains right after.
+	   Interrupts are charged to the task they interrupted. */
+	if (yapos_next_task != stats_task) {
+		stats_sample();
+		stats_task->switches[cause]++;
+		stats_task = (struct task *)yapos_next_task;
+	}
+#else
+	(void)cause;
+#endif
+
+#ifdef YAPOS_CONF_TICKLESS
+	/* Nothing to run until the next timeout: suppress the ticks */
+	if (yapos_next_task == &idle_task)
+		tickless_enter();
+	else if (tickless_span > 1)
+		tickless_abort();
+#endif
+
+	/* PendSV only when there is a switch to perform (if it is already
+	   pending, it finds the running task selected and returns early) */
+	if (dispatch)
+		SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+/* Block the current task for the given number of ticks */
+static void task_sleep(uint32_t delay)
+{
+	struct task *p_curr = (struct task *)yapos_curr_task;
+
+	ready_remove(p_curr);
+	timeout_insert(p_curr, delay);
+	schedule(YAPOS_SWITCH_BLOCKED);
+}
+
+/* Block the current task on a wait queue for up to timeout ticks (or
+   YAPOS_WAIT_FOREVER), until released by wait_wake(). Called by supervisor
+   calls only: the result of the wait is written later to the stacked R0 of
+   the task, the calling service returns YAPOS_ERR_TIMEOUT meanwhile. The
+   caller is in charge of calling schedule(). */
+static void task_wait(struct yapos_wait *p_wait, uint32_t timeout)
+{
+	struct task *p_curr = (struct task *)yapos_curr_task;
+
+	ready_remove(p_curr);
+	wait_insert(p_wait, p_curr);
+	p_curr->wait_ret = (uint32_t *)__get_PSP();
+	if (timeout != YAPOS_WAIT_FOREVER)
+		timeout_insert(p_curr, timeout);
+}
+
+/* Release task blocked on a wait queue with the given result of its wait.
+   The caller is in charge of calling schedule(). */
+static void wait_release(struct task *p_task, uint32_t result)
+{
+	wait_remove(p_task);
+	*p_task->wait_ret = result;
+	if (p_task->tlink != NULL)
+		timeout_remove(p_task);
+	ready_insert(p_task);
+}
+
+/* Release the highest priority task of a wait queue with the given result
+   of its wait, return it (NULL if the queue is empty). The caller is in
+   charge of calling schedule(). */
+static struct task *wait_wake(struct yapos_wait *p_wait, uint32_t result)
+{
+	struct task *p_task = p_wait->head;
+	if (p_task != NULL)
+		wait_release(p_task, result);
+
+	return p_task;
+}
+
+/* Give semaphore: the token is handed over directly to the highest
+   priority waiter, if any, so it never has to retry taking it */
+static yapos_err_t sem_give(struct yapos_sem *p_sem)
+{
+	if (wait_wake(&p_sem->wait, YAPOS_ERR_OK) != NULL) {
+		schedule(YAPOS_SWITCH_PREEMPTED);
+		return YAPOS_ERR_OK;
+	}
+
+	if (p_sem->count >= p_sem->max)
+		return YAPOS_ERR_OVERFLOW;
+	p_sem->count++;
+
+	return YAPOS_ERR_OK;
+}
+
+/* Deliver a message to a receive buffer (pointer mode: the message is the
+   pointer itself) */
+static void queue_copy(const struct yapos_queue *p_queue, void *p_dst,
+		const void *p_msg)
+{
+	if (p_queue->msg_size == 0)
+		*(const void **)p_dst = p_msg;
+	else
+		memcpy(p_dst, p_msg, p_queue->msg_size);
+}
+
+/* Append message to the queue storage, which has room for it */
+static void queue_put(struct yapos_queue *p_queue, const void *p_msg)
+{
+	uint32_t tail = p_queue->head + p_queue->count;
+	if (tail >= p_queue->capacity)
+		tail -= p_queue->capacity;
+
+	if (p_queue->msg_size == 0)
+		((const void **)p_queue->buf)[tail] = p_msg;
+	else
+		memcpy(p_queue->buf + tail*p_queue->msg_size, p_msg,
+				p_queue->msg_size);
+	p_queue->count++;
+}
+
+/* Remove the oldest message from the queue storage, which is not empty */
+static void queue_get(struct yapos_queue *p_queue, void *p_msg)
+{
+	if (p_queue->msg_size == 0)
+		*(void **)p_msg = ((void **)p_queue->buf)[p_queue->head];
+	else
+		memcpy(p_msg, p_queue->buf + p_queue->head*p_queue->msg_size,
+				p_queue->msg_size);
+
+	if (++p_queue->head == p_queue->capacity)
+		p_queue->head = 0;
+	p_queue->count--;
+}
+
+/* Send message without blocking: it is copied straight to the buffer of
+   the highest priority waiting receiver, if any, else queued.
+   YAPOS_ERR_TIMEOUT means that the queue is full. */
+static yapos_err_t queue_send(struct yapos_queue *p_queue, const void *p_msg)
+{
+	struct task *p_task = p_queue->recv_wait.head;
+	if (p_task != NULL) {
+		queue_copy(p_queue, p_task->wait_msg, p_msg);
+		wait_wake(&p_queue->recv_wait, YAPOS_ERR_OK);
+		schedule(YAPOS_SWITCH_PREEMPTED);
+		return YAPOS_ERR_OK;
+	}
+
+	if (p_queue->count == p_queue->capacity)
+		return YAPOS_ERR_TIMEOUT;
+	queue_put(p_queue, p_msg);
+
+	return YAPOS_ERR_OK;
+}
+
+/* Receive message without blocking, the message of the highest priority
+   waiting sender, if any, takes the freed slot. YAPOS_ERR_TIMEOUT means
+   that the queue is empty. */
+static yapos_err_t queue_receive(struct yapos_queue *p_queue, void *p_msg)
+{
+	if (p_queue->count == 0)
+		return YAPOS_ERR_TIMEOUT;
+	queue_get(p_queue, p_msg);
+
+	struct task *p_task = p_queue->send_wait.head;
+	if (p_task != NULL) {
+		queue_put(p_queue, p_task->wait_msg);
+		wait_wake(&p_queue->send_wait, YAPOS_ERR_OK);
+		schedule(YAPOS_SWITCH_PREEMPTED);
+	}
+
+	return YAPOS_ERR_OK;
+}
+
+/* Check whether the matched flags satisfy a wait for mask */
+static bool event_satisfied(uint32_t match, uint32_t mask, uint8_t opts)
+{
+	if (opts & YAPOS_EVENT_ALL)
+		return match == mask;
+
+	return match != 0;
+}
+
+/* Set flags of an event group. Waking the waiters is deferred to
+   PendSV_Handler, so an interrupt only queues the group (once until the
+   deferred run) and a burst of set operations costs a single switch. */
+static void event_set(struct yapos_event *p_event, uint32_t flags)
+{
+	p_event->flags |= flags;
+
+	if (p_event->wait.head == NULL || p_event->pending)
+		return;
+
+	p_event->pending = true;
+	p_event->next = event_pending;
+	event_pending = p_event;
+	yapos_deferred |= DEFERRED_EVENTS;
+	SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+/* Release every waiter satisfied by the flags of an event group, which are
+   then cleared as requested by the waiters (all of them see the same
+   flags). A waiter gets the flags as result of its wait. */
+static void event_match(struct yapos_event *p_event)
+{
+	uint32_t flags = p_event->flags;
+	uint32_t clear = 0;
+	struct task *p_task = p_event->wait.head;
+
+	while (p_task != NULL) {
+		struct task *p_next = p_task->wnext;
+		uint32_t match = flags & p_task->wait_flags;
+
+		if (event_satisfied(match, p_task->wait_flags, p_task->wait_opts)) {
+			if (p_task->wait_opts & YAPOS_EVENT_CLEAR)
+				clear |= match;
+			wait_release(p_task, flags);
+		}
+
+		p_task = p_next;
+	}
+
+	p_event->flags &= ~clear;
+}
+
+/* Deferred kernel work, called by PendSV_Handler before the switch when
+   yapos_deferred is set: waiters of all the event groups set since the
+   last run are matched, the running task is moved behind its peers at
+   the end of a tick, then the next task is selected */
+void KERNEL_CCMFUNC yapos_deferred_run(void)
+{
+	uint32_t state = kernel_lock();
+
+	uint32_t deferred = yapos_deferred;
+	yapos_deferred = 0;
+	while (event_pending != NULL) {
+		struct yapos_event *p_event = event_pending;
+		event_pending = p_event->next;
+		p_event->pending = false;
+		event_match(p_event);
+	}
+
+#ifndef YAPOS_CONF_COOPERATIVE
+	/* Round-robin among the ready tasks sharing the running task's
+	   priority, its time slice expired: the running task is moved behind
+	   its peers, with a new slice if it is the only one */
+	struct task *p_curr = (struct task *)yapos_curr_task;
+	if (deferred & DEFERRED_TICK) {
+		if (ready_q.lists[p_curr->prio] == p_curr)
+			ready_q.lists[p_curr->prio] = p_curr->next;
+		p_curr->slice_left = p_curr->slice;
+	}
+#else
+	(void)deferred;
+#endif
+
+	schedule(YAPOS_SWITCH_PREEMPTED);
+	/* PendSV_Handler switches to the selected task right after */
+	SCB->ICSR = SCB_ICSR_PENDSVCLR_Msk;
+
+	kernel_unlock(state);
+}
+
+/* Receive the notification of a task: get the value and clear the given
+   flags of it */
+static void notify_take(struct task *p_task, uint32_t *p_value, uint32_t clear)
+{
+	if (p_value != NULL)
+		*p_value = p_task->notify_value;
+	p_task->notify_value &= ~clear;
+	p_task->notify_pending = false;
+}
+
+/* Update the notification word of a task, which receives it right away if
+   waiting for it */
+static void task_notify(struct task *p_task, uint32_t value,
+		yapos_notify_action_t action)
+{
+	switch (action) {
+	case YAPOS_NOTIFY_SET_BITS:
+		p_task->notify_value |= value;
+		break;
+	case YAPOS_NOTIFY_INCREMENT:
+		p_task->notify_value++;
+		break;
+	default:
+		p_task->notify_value = value;
+		break;
+	}
+
+	if (p_task->wait != &p_task->notify_wait) {
+		p_task->notify_pending = true;
+		return;
+	}
+
+	notify_take(p_task, p_task->wait_msg, p_task->wait_flags);
+	wait_release(p_task, YAPOS_ERR_OK);
+	schedule(YAPOS_SWITCH_PREEMPTED);
+}
+
+/* Terminate the current task: it leaves scheduling for good and the tasks
+   joining it get the value it exited with */
+static void task_exit(void *retval)
+{
+	struct task *p_curr = (struct task *)yapos_curr_task;
+	struct task *p_joiner;
+
+	ready_remove(p_curr);
+	p_curr->state = TASK_EXITED;
+	p_curr->retval = retval;
+
+	while ((p_joiner = p_curr->join_wait.head) != NULL) {
+		if (p_joiner->wait_msg != NULL)
+			*(void **)p_joiner->wait_msg = retval;
+		wait_release(p_joiner, YAPOS_ERR_OK);
+	}
+
+	schedule(YAPOS_SWITCH_BLOCKED);
+}
+
+/* Delete task, whatever its state, and free its slot of the tasks table.
+   The tasks joining it get YAPOS_ERR_WRONG_STATE. A task owning mutexes
+   cannot be deleted: they would be left to the next task in its slot, with
+   the priority inherited through them. */
+static yapos_err_t task_delete(struct task *p_task)
+{
+	if (!task_valid(p_task) || p_task == &idle_task ||
+			p_task->state == TASK_FREE)
+		return YAPOS_ERR_INVALID_PARAM;
+	if (p_task->mutexes != 0)
+		return YAPOS_ERR_WRONG_STATE;
+
+	if (p_task->state == TASK_ACTIVE) {
+		if (p_task->wait != NULL) {
+			wait_remove(p_task);
+			if (p_task->wait_mutex != NULL)
+				mutex_wait_abort(p_task);
+		} else if (p_task->tlink == NULL) {
+			ready_remove(p_task);
+		}
+		if (p_task->tlink != NULL)
+			timeout_remove(p_task);
+
+		while (p_task->join_wait.head != NULL)
+			wait_wake(&p_task->join_wait, YAPOS_ERR_WRONG_STATE);
+	}
+
+	p_task->state = TASK_FREE;
+	p_task->handler = NULL;
+
+	/* Deleting itself, or the woken up joiners may preempt the caller */
+	if (yapos_curr_task != NULL)
+		schedule(p_task == yapos_curr_task ? YAPOS_SWITCH_BLOCKED :
+				YAPOS_SWITCH_PREEMPTED);
+
+	return YAPOS_ERR_OK;
+}
+
+static yapos_err_t task_create(const struct yapos_task_attr *p_attr,
+		yapos_task_t *p_task);
+
+/* Install the handler of an interrupt line in the relocated vector table */
+static yapos_err_t irq_attach(IRQn_Type irqn, void (*handler)(void),
+		uint32_t prio)
+{
+#ifdef YAPOS_CONF_IRQ_VECTORS
+	if (!init)
+		return YAPOS_ERR_WRONG_STATE;
+	if ((int32_t)irqn < 0 || (uint32_t)irqn >= YAPOS_CONF_IRQ_VECTORS ||
+			handler == NULL || prio >= (1UL << __NVIC_PRIO_BITS))
+		return YAPOS_ERR_INVALID_PARAM;
+
+	NVIC_DisableIRQ(irqn);
+	vectors[16 + irqn] = (uint32_t)handler;
+	/* The new vector is visible before the line is enabled */
+	__DSB();
+	NVIC_SetPriority(irqn, prio);
+	NVIC_EnableIRQ(irqn);
+
+	return YAPOS_ERR_OK;
+#else
+	(void)irqn;
+	(void)handler;
+	(void)prio;
+	return YAPOS_ERR_WRONG_STATE;
+#endif
+}
+
+/* Create task with attributes a0, its handle is stored to a1 */
+SVC_FUNC(svc_task_create)
+{
+#ifdef YAPOS_CONF_MPU
+	struct task *p_curr = (struct task *)yapos_curr_task;
+	const struct yapos_task_attr *p_attr =
+			(const struct yapos_task_attr *)a0;
+
+	if (a1 != 0 && !mpu_buf_valid(p_curr, (void *)a1, sizeof(yapos_task_t)))
+		return YAPOS_ERR_INVALID_PARAM;
+
+	/* An unprivileged task may only hand its own memory over to the new
+	   one: stack and data within its stack or data region, peripherals
+	   within its peripheral window */
+	if ((__get_CONTROL() & 0x1) != 0 && p_attr != NULL) {
+		const struct yapos_task_mpu *p_mpu = p_attr->p_mpu;
+		if (!mpu_buf_valid(p_curr, p_attr->stack, p_attr->stack_size*4))
+			return YAPOS_ERR_INVALID_PARAM;
+		if (p_mpu != NULL &&
+				((p_mpu->data.size != 0 &&
+				  !mpu_buf_valid(p_curr, p_mpu->data.base,
+						p_mpu->data.size)) ||
+				 (p_mpu->periph.size != 0 &&
+				  !mpu_region_contains(&p_curr->mpu[4],
+						(uint32_t)p_mpu->periph.base,
+						p_mpu->periph.size))))
+			return YAPOS_ERR_INVALID_PARAM;
+	}
+#endif
+
+	return task_create((const struct yapos_task_attr *)a0,
+			(yapos_task_t *)a1);
+}
+
+SVC_FUNC(svc_task_exit)
+{
+	task_exit((void *)a0);
+
+	return 0;
+}
+
+/* Wait up to a2 ticks for task a0 to exit, store its value to a1 */
+SVC_FUNC(svc_task_join)
+{
+	struct task *p_task = (struct task *)a0;
+
+	/* The idle task never exits */
+	if (!task_valid(p_task) || p_task == &idle_task)
+		return YAPOS_ERR_INVALID_PARAM;
+	if (p_task == yapos_curr_task || p_task->state == TASK_FREE)
+		return YAPOS_ERR_WRONG_STATE;
+
+#ifdef YAPOS_CONF_MPU
+	/* Written now or when the task exits */
+	if (a1 != 0 && !mpu_buf_valid((struct task *)yapos_curr_task,
+			(void *)a1, sizeof(void *)))
+		return YAPOS_ERR_INVALID_PARAM;
+#endif
+
+	if (p_task->state == TASK_EXITED) {
+		if (a1 != 0)
+			*(void **)a1 = p_task->retval;
+		return YAPOS_ERR_OK;
+	}
+
+	if (a2 != 0) {
+		task_wait(&p_task->join_wait, a2);
+		yapos_curr_task->wait_msg = (void *)a1;
+		schedule(YAPOS_SWITCH_BLOCKED);
+	}
+
+	return YAPOS_ERR_TIMEOUT;
+}
+
+SVC_FUNC(svc_task_delete)
+{
+	return task_delete((struct task *)a0);
+}
+
+/* Give up the CPU: the calling task moves behind the ready tasks of its
+   priority level and the next task is selected right away */
+SVC_FUNC(svc_yield)
+{
+	struct task *p_curr = (struct task *)yapos_curr_task;
+
+	if (ready_q.lists[p_curr->prio] == p_curr)
+		ready_q.lists[p_curr->prio] = p_curr->next;
+	schedule(YAPOS_SWITCH_YIELDED);
+
+	return 0;
+}
+
+/* Block the calling task for a0 ticks */
+SVC_FUNC(svc_sleep)
+{
+	if (a0 > 0)
+		task_sleep(a0);
+
+	return 0;
+}
+
+/* Block the calling task until a1 ticks after the release time pointed by
+   a0. Release times are absolute, so the time spent running between two
+   calls does not accumulate. */
+SVC_FUNC(svc_sleep_until)
+{
+	uint32_t *p_last_wake = (uint32_t *)a0;
+#ifdef YAPOS_CONF_MPU
+	if (!mpu_buf_valid((struct task *)yapos_curr_task, p_last_wake,
+			sizeof(*p_last_wake)))
+		return YAPOS_ERR_INVALID_PARAM;
+#endif
+	*p_last_wake += a1;
+
+	int32_t delay = (int32_t)(*p_last_wake - ticks);
+	if (delay > 0)
+		task_sleep(delay);
+
+	return 0;
+}
+
+SVC_FUNC(svc_get_ticks)
+{
+	return ticks;
+}
+
+SVC_FUNC(svc_get_task_stats)
+{
+#ifdef YAPOS_CONF_MPU
+	struct task *p_curr = (struct task *)yapos_curr_task;
+	size_t *p_count = (size_t *)a1;
+
+	/* No more entries than tasks are written */
+	if (!mpu_buf_valid(p_curr, p_count, sizeof(*p_count)) ||
+			(*p_count > 0 && !mpu_buf_valid(p_curr, (void *)a0,
+					(*p_count < YAPOS_CONF_MAX_TASKS ?
+					 *p_count : YAPOS_CONF_MAX_TASKS) *
+					sizeof(struct yapos_task_stats))) ||
+			(a2 != 0 && !mpu_buf_valid(p_curr, (void *)a2,
+					sizeof(struct yapos_task_stats))))
+		return YAPOS_ERR_INVALID_PARAM;
+#endif
+
+	return task_stats_get((struct yapos_task_stats *)a0, (size_t *)a1,
+			(struct yapos_task_stats *)a2);
+}
+
+/* Copy the tick cost statistics to a0 */
+SVC_FUNC(svc_get_tick_stats)
+{
+#ifdef YAPOS_CONF_MPU
+	if (!mpu_buf_valid((struct task *)yapos_curr_task, (void *)a0,
+			sizeof(struct yapos_tick_stats)))
+		return YAPOS_ERR_INVALID_PARAM;
+#endif
+
+	return tick_stats_get((struct yapos_tick_stats *)a0);
+}
+
+/* Take semaphore a0, waiting up to a1 ticks */
+SVC_FUNC(svc_sem_take)
+{
+	struct yapos_sem *p_sem = (struct yapos_sem *)a0;
+
+	if (!task_obj_valid(p_sem, sizeof(*p_sem)))
+		return YAPOS_ERR_INVALID_PARAM;
+
+	if (p_sem->count > 0) {
+		p_sem->count--;
+		return YAPOS_ERR_OK;
+	}
+
+	if (a1 != 0) {
+		task_wait(&p_sem->wait, a1);
+		schedule(YAPOS_SWITCH_BLOCKED);
+	}
+
+	return YAPOS_ERR_TIMEOUT;
+}
+
+SVC_FUNC(svc_sem_give)
+{
+	if (!task_obj_valid((void *)a0, sizeof(struct yapos_sem)))
+		return YAPOS_ERR_INVALID_PARAM;
+
+	return sem_give((struct yapos_sem *)a0);
+}
+
+/* Lock mutex a0, waiting up to a1 ticks. The owner inherits the priority
+   of the calling task while it waits. */
+SVC_FUNC(svc_mutex_lock)
+{
+	struct yapos_mutex *p_mutex = (struct yapos_mutex *)a0;
+	struct task *p_curr = (struct task *)yapos_curr_task;
+
+	if (!task_obj_valid(p_mutex, sizeof(*p_mutex)))
+		return YAPOS_ERR_INVALID_PARAM;
+
+	/* The owner is linked to the mutex (and has its priority raised) */
+	struct task *p_owner = mutex_owner(p_mutex);
+	if (p_owner != NULL && !task_valid(p_owner))
+		return YAPOS_ERR_INVALID_PARAM;
+
+	if (p_owner == NULL) {
+		p_mutex->owner = (uint32_t)p_curr;
+		p_mutex->count = 1;
+		p_curr->mutexes++;
+		return YAPOS_ERR_OK;
+	}
+
+	if (p_owner == p_curr) {
+		p_mutex->count++;
+		return YAPOS_ERR_OK;
+	}
+
+	if (a1 == 0)
+		return YAPOS_ERR_TIMEOUT;
+
+	if ((p_mutex->owner & MUTEX_WAITERS) == 0) {
+		p_mutex->owner |= MUTEX_WAITERS;
+		mutex_held_add(p_owner, p_mutex);
+	}
+
+	task_wait(&p_mutex->wait, a1);
+	p_curr->wait_mutex = p_mutex;
+	mutex_prio_update(p_owner);
+	schedule(YAPOS_SWITCH_BLOCKED);
+
+	return YAPOS_ERR_TIMEOUT;
+}
+
+/* Unlock mutex a0: ownership is handed over to the highest priority
+   waiter and the calling task drops the priority it inherited from it */
+SVC_FUNC(svc_mutex_unlock)
+{
+	struct yapos_mutex *p_mutex = (struct yapos_mutex *)a0;
+	struct task *p_curr = (struct task *)yapos_curr_task;
+
+	if (!task_obj_valid(p_mutex, sizeof(*p_mutex)))
+		return YAPOS_ERR_INVALID_PARAM;
+	if (mutex_owner(p_mutex) != p_curr)
+		return YAPOS_ERR_WRONG_STATE;
+
+	if (p_mutex->count > 1) {
+		p_mutex->count--;
+		return YAPOS_ERR_OK;
+	}
+
+	p_curr->mutexes--;
+	if ((p_mutex->owner & MUTEX_WAITERS) == 0) {
+		p_mutex->owner = 0;
+		return YAPOS_ERR_OK;
+	}
+
+	mutex_held_remove(p_curr, p_mutex);
+
+	struct task *p_next = wait_wake(&p_mutex->wait, YAPOS_ERR_OK);
+	p_next->wait_mutex = NULL;
+	p_next->mutexes++;
+	p_mutex->count = 1;
+	if (p_mutex->wait.head != NULL) {
+		p_mutex->owner = (uint32_t)p_next | MUTEX_WAITERS;
+		mutex_held_add(p_next, p_mutex);
+		mutex_prio_update(p_next);
+	} else {
+		p_mutex->owner = (uint32_t)p_next;
+	}
+
+	mutex_prio_update(p_curr);
+	schedule(YAPOS_SWITCH_PREEMPTED);
+
+	return YAPOS_ERR_OK;
+}
+
+/* Check queue a0 and its storage, which the kernel writes messages to */
+static bool queue_valid(const struct yapos_queue *p_queue)
+{
+	if (!task_obj_valid(p_queue, sizeof(*p_queue)))
+		return false;
+
+	uint64_t size = (uint64_t)p_queue->capacity *
+			(p_queue->msg_size != 0 ? p_queue->msg_size : sizeof(void *));
+
+	return size <= UINT32_MAX && task_obj_valid(p_queue->buf, size) &&
+			p_queue->head < p_queue->capacity &&
+			p_queue->count <= p_queue->capacity;
+}
+
+/* Send message a1 to queue a0, waiting up to a2 ticks for room */
+SVC_FUNC(svc_queue_send)
+{
+	struct yapos_queue *p_queue = (struct yapos_queue *)a0;
+
+	if (!queue_valid(p_queue))
+		return YAPOS_ERR_INVALID_PARAM;
+
+	yapos_err_t err_code = queue_send(p_queue, (const void *)a1);
+	if (err_code == YAPOS_ERR_TIMEOUT && a2 != 0) {
+		task_wait(&p_queue->send_wait, a2);
+		yapos_curr_task->wait_msg = (void *)a1;
+		schedule(YAPOS_SWITCH_BLOCKED);
+	}
+
+	return err_code;
+}
+
+/* Receive message from queue a0 into buffer a1, waiting up to a2 ticks */
+SVC_FUNC(svc_queue_receive)
+{
+	struct yapos_queue *p_queue = (struct yapos_queue *)a0;
+
+	if (!queue_valid(p_queue))
+		return YAPOS_ERR_INVALID_PARAM;
+
+#ifdef YAPOS_CONF_MPU
+	/* Written now or when a sender hands over its message */
+	if (!mpu_buf_valid((struct task *)yapos_curr_task, (void *)a1,
+			p_queue->msg_size != 0 ? p_queue->msg_size : sizeof(void *)))
+		return YAPOS_ERR_INVALID_PARAM;
+#endif
+
+	yapos_err_t err_code = queue_receive(p_queue, (void *)a1);
+	if (err_code == YAPOS_ERR_TIMEOUT && a2 != 0) {
+		task_wait(&p_queue->recv_wait, a2);
+		yapos_curr_task->wait_msg = (void *)a1;
+		schedule(YAPOS_SWITCH_BLOCKED);
+	}
+
+	return err_code;
+}
+
+SVC_FUNC(svc_event_set)
+{
+	if (!task_obj_valid((void *)a0, sizeof(struct yapos_event)))
+		return YAPOS_ERR_INVALID_PARAM;
+
+	event_set((struct yapos_event *)a0, a1);
+
+	return YAPOS_ERR_OK;
+}
+
+/* Clear flags a1 of event group a0 (without exclusive accesses) */
+SVC_FUNC(svc_event_clear)
+{
+	struct yapos_event *p_event = (struct yapos_event *)a0;
+
+	if (!task_obj_valid(p_event, sizeof(*p_event)))
+		return YAPOS_ERR_INVALID_PARAM;
+
+	uint32_t state = kernel_lock();
+
+	p_event->flags &= ~a1;
+
+	kernel_unlock(state);
+
+	return YAPOS_ERR_OK;
+}
+
+/* Get flags of event group a0 */
+SVC_FUNC(svc_event_get)
+{
+	const struct yapos_event *p_event = (const struct yapos_event *)a0;
+
+	if (!task_obj_valid(p_event, sizeof(*p_event)))
+		return 0;
+
+	return p_event->flags;
+}
+
+/* Wait up to a3 ticks for flags a1 of event group a0, options a2 */
+SVC_FUNC(svc_event_wait)
+{
+	struct yapos_event *p_event = (struct yapos_event *)a0;
+
+	/* No flags reported */
+	if (!task_obj_valid(p_event, sizeof(*p_event)))
+		return 0;
+
+	uint32_t flags = p_event->flags;
+	uint32_t match = flags & a1;
+
+	if (event_satisfied(match, a1, a2)) {
+		if (a2 & YAPOS_EVENT_CLEAR)
+			p_event->flags = flags & ~match;
+		return flags;
+	}
+
+	if (a3 != 0) {
+		task_wait(&p_event->wait, a3);
+		yapos_curr_task->wait_flags = a1;
+		yapos_curr_task->wait_opts = a2;
+		schedule(YAPOS_SWITCH_BLOCKED);
+	}
+
+	return 0;
+}
+
+/* Notify task a0 with value a1, action a2 */
+SVC_FUNC(svc_notify)
+{
+	if (!task_valid((struct task *)a0))
+		return YAPOS_ERR_INVALID_PARAM;
+
+	task_notify((struct task *)a0, a1, (yapos_notify_action_t)a2);
+
+	return YAPOS_ERR_OK;
+}
+
+/* Wait up to a2 ticks for a notification, store its value to a1 and clear
+   flags a0 of it */
+SVC_FUNC(svc_notify_wait)
+{
+	struct task *p_curr = (struct task *)yapos_curr_task;
+
+#ifdef YAPOS_CONF_MPU
+	/* Written now or when the task is notified */
+	if (a1 != 0 && !mpu_buf_valid(p_curr, (void *)a1, sizeof(uint32_t)))
+		return YAPOS_ERR_INVALID_PARAM;
+#endif
+
+	if (p_curr->notify_pending) {
+		notify_take(p_curr, (uint32_t *)a1, a0);
+		return YAPOS_ERR_OK;
+	}
+
+	if (a2 != 0) {
+		task_wait(&p_curr->notify_wait, a2);
+		p_curr->wait_msg = (void *)a1;
+		p_curr->wait_flags = a0;
+		schedule(YAPOS_SWITCH_BLOCKED);
+	}
+
+	return YAPOS_ERR_TIMEOUT;
+}
+
+/* Mask interrupts (BASEPRI is not stacked, the mask stays set on return
+   to the task), return the previous state. Only called with BASEPRI (see
+   yapos_irq_lock()). */
+SVC_FUNC(svc_irq_lock)
+{
+	return kernel_lock();
+}
+
+SVC_FUNC(svc_irq_unlock)
+{
+	kernel_unlock(a0);
+
+	return 0;
+}
+
+SVC_FUNC(svc_irq_enable)
+{
+	if ((int32_t)a0 < 0)
+		return YAPOS_ERR_INVALID_PARAM;
+	NVIC_EnableIRQ((IRQn_Type)a0);
+
+	return YAPOS_ERR_OK;
+}
+
+SVC_FUNC(svc_irq_disable)
+{
+	if ((int32_t)a0 < 0)
+		return YAPOS_ERR_INVALID_PARAM;
+	NVIC_DisableIRQ((IRQn_Type)a0);
+
+	return YAPOS_ERR_OK;
+}
+
+/* Attach handler a1 to interrupt line a0, with priority a2 */
+SVC_FUNC(svc_irq_attach)
+{
+	return irq_attach((IRQn_Type)a0, (void (*)(void))a1, a2);
+}
+
+/* Run a service from main() before yapos_start(), when there is no task
+   stack to make a supervisor call from, masked as a supervisor call would
+   be. No task waits on anything yet. */
+static uint32_t svc_direct(svc_func_t func, uint32_t a0, uint32_t a1,
+		uint32_t a2)
+{
+	uint32_t state = kernel_lock();
+	uint32_t ret_val = func(a0, a1, a2, 0);
+	kernel_unlock(state);
+
+	return ret_val;
+}
+
+/* Supervisor call services, indexed by SVC number */
+static const svc_func_t svc_table[YAPOS_SVC_COUNT] __attribute__((used)) = {
+	[YAPOS_SVC_SLEEP] = &svc_sleep,
+	[YAPOS_SVC_SLEEP_UNTIL] = &svc_sleep_until,
+	[YAPOS_SVC_GET_TICKS] = &svc_get_ticks,
+	[YAPOS_SVC_GET_TASK_STATS] = &svc_get_task_stats,
+	[YAPOS_SVC_IRQ_LOCK] = &svc_irq_lock,
+	[YAPOS_SVC_IRQ_UNLOCK] = &svc_irq_unlock,
+	[YAPOS_SVC_IRQ_ENABLE] = &svc_irq_enable,
+	[YAPOS_SVC_IRQ_DISABLE] = &svc_irq_disable,
+	[YAPOS_SVC_SEM_TAKE] = &svc_sem_take,
+	[YAPOS_SVC_SEM_GIVE] = &svc_sem_give,
+	[YAPOS_SVC_MUTEX_LOCK] = &svc_mutex_lock,
+	[YAPOS_SVC_MUTEX_UNLOCK] = &svc_mutex_unlock,
+	[YAPOS_SVC_QUEUE_SEND] = &svc_queue_send,
+	[YAPOS_SVC_QUEUE_RECEIVE] = &svc_queue_receive,
+	[YAPOS_SVC_EVENT_SET] = &svc_event_set,
+	[YAPOS_SVC_EVENT_WAIT] = &svc_event_wait,
+	[YAPOS_SVC_NOTIFY] = &svc_notify,
+	[YAPOS_SVC_NOTIFY_WAIT] = &svc_notify_wait,
+	[YAPOS_SVC_YIELD] = &svc_yield,
+	[YAPOS_SVC_TASK_CREATE] = &svc_task_create,
+	[YAPOS_SVC_TASK_EXIT] = &svc_task_exit,
+	[YAPOS_SVC_TASK_JOIN] = &svc_task_join,
+	[YAPOS_SVC_TASK_DELETE] = &svc_task_delete,
+	[YAPOS_SVC_IRQ_ATTACH] = &svc_irq_attach,
+	[YAPOS_SVC_GET_TICK_STATS] = &svc_get_tick_stats,
+	[YAPOS_SVC_EVENT_CLEAR] = &svc_event_clear,
+	[YAPOS_SVC_EVENT_GET] = &svc_event_get,
+};
+
+#ifdef YAPOS_PORT_ARMV7M
+/* SVC exception entry (tasks always run on PSP): the SVC number, encoded
+   in the instruction before the stacked PC, indexes svc_table and the
+   service is called with R0-R3 loaded straight from the stacked frame */
+__attribute__((naked)) void SVC_Handler(void)
+{
+	__asm volatile (
+		"mrs	r12, psp\n"
+		"ldr	r1, [r12, #24]\n"
+		"ldrb	r1, [r1, #-2]\n"
+		"cmp	r1, #" SVC_XSTR(YAPOS_SVC_COUNT) "\n"
+		"it	hs\n"
+		"bxhs	lr\n"
+		"movw	r2, #:lower16:svc_table\n"
+		"movt	r2, #:upper16:svc_table\n"
+		"ldr	r2, [r2, r1, lsl #2]\n"
+		"push	{r12, lr}\n"
+		"ldmia	r12, {r0-r3}\n"
+		"blx	r2\n"
+		"pop	{r12, lr}\n"
+		"str	r0, [r12]\n"
+		"bx	lr\n"
+	);
+}
+#else
+/* Dispatch supervisor call: the SVC number is encoded in the instruction
+   before the stacked PC, arguments and return value are passed in R0-R3
+   of the exception frame stacked by the calling task */
+static void __attribute__((used)) svc_dispatch(uint32_t *frame)
+{
+	uint8_t svc_num = ((uint8_t *)frame[6])[-2];
+
+	if (svc_num < YAPOS_SVC_COUNT)
+		frame[0] = svc_table[svc_num](frame[0], frame[1], frame[2],
+				frame[3]);
+}
+
+/* SVC exception entry, tasks always run on PSP */
+__attribute__((naked)) void SVC_Handler(void)
+{
+	__asm volatile (
+		"mrs	r0, psp\n"
+		"ldr	r1, =svc_dispatch\n"
+		"bx	r1\n"
+	);
+}
+#endif
+
+/* Idle task, running when no other task is ready */
+static void idle_handler(void *params)
+{
+	(void)params;
+
+	while (1)
+		__WFI();
+}
+
+/* Prepare task descriptor and initial stack frame */
+static void task_setup(struct task *p_task, void (*handler)(void *params),
+		void *params, uint32_t *stack, size_t stack_size, uint8_t prio)
+{
+	/* Initialize the task structure and set SP to the top of the stack
+	   minus the space for storing the initial context */
+	p_task->handler = handler;
+	p_task->params = params;
+	p_task->state = TASK_ACTIVE;
+	p_task->prio = prio;
+	p_task->base_prio = prio;
+	p_task->sp = (uint32_t)(stack+stack_size-CTX_WORDS);
+
+#ifdef YAPOS_CONF_STACK_CHECK
+	/* Fill the stack below the initial context */
+	p_task->stack = stack;
+	for (size_t i = 0; i < stack_size-CTX_WORDS; i++)
+		stack[i] = STACK_FILL;
+#endif
+
+	/* Save init. values of registers which will be restored on exc. return:
+	   - XPSR: Default value (0x01000000)
+	   - PC: Point to the handler function
+	   - LR: Point to a function to be called when the handler returns
+	   - R0: Point to the handler function's parameter */
+	stack[stack_size-1] = 0x01000000;
+	stack[stack_size-2] = (uint32_t)handler;
+	stack[stack_size-3] = (uint32_t)&task_finished;
+	stack[stack_size-8] = (uint32_t)params;
+
+#if CTX_SW_WORDS > 8
+	/* EXC_RETURN, saved by PendSV_Handler below (ARMv6-M) or above
+	   (ARMv7-M) registers R4-R11 */
+#ifdef YAPOS_PORT_ARMV7M
+	stack[stack_size-CTX_HW_WORDS-1] = CTX_EXC_RETURN;
+#else
+	stack[stack_size-CTX_WORDS] = CTX_EXC_RETURN;
+#endif
+#endif
+
+#ifdef YAPOS_CONF_DEBUG
+	uint32_t base = (tasks_tab.size+1)*1000;
+	stack[stack_size-4] = base+12;  /* R12 */
+	stack[stack_size-5] = base+3;   /* R3  */
+	stack[stack_size-6] = base+2;   /* R2  */
+	stack[stack_size-7] = base+1;   /* R1  */
+	/* p_stack[stack_size-8] is R0 */
+#ifdef YAPOS_PORT_ARMV7M
+	/* R4-R11, lowest address first */
+	uint32_t *regs = stack+stack_size-CTX_WORDS;
+	for (uint32_t i = 0; i < 8; i++)
+		regs[i] = base+4+i;
+#else
+	/* R8-R11, R4-R7, lowest address first */
+	uint32_t *regs = stack+stack_size-CTX_HW_WORDS-8;
+	for (uint32_t i = 0; i < 8; i++)
+		regs[i] = base+4+(i^4);
+#endif
+#endif
+
+	ready_insert(p_task);
+}
+
+#ifdef YAPOS_CONF_CCMFUNC_LOCK
+/* Write-protect the CCM SRAM pages holding code, until reset (the kernel
+   data placed after it starts on the next page, see linker/sections.ld) */
+static void ccmfunc_lock(void)
+{
+	uint32_t first = ((uint32_t)_sccmfunc - CCMDATARAM_BASE) / CCM_PAGE_SIZE;
+	uint32_t end = ((uint32_t)_eccmfunc - CCMDATARAM_BASE + CCM_PAGE_SIZE - 1)
+			/ CCM_PAGE_SIZE;
+
+	RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+	for (uint32_t page = first; page < end; page++)
+		SYSCFG->RCR |= 1UL << page;
+}
+#endif
+
+#ifdef YAPOS_CONF_IRQ_VECTORS
+/* Copy the vector table (in flash) to RAM and switch to that copy */
+static void vectors_relocate(void)
+{
+	const uint32_t *p_table = (const uint32_t *)SCB->VTOR;
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	for (uint32_t i = 0; i < VECTORS_COUNT; i++)
+		vectors[i] = p_table[i];
+	SCB->VTOR = (uint32_t)vectors;
+	__DSB();
+	__ISB();
+	__set_PRIMASK(primask);
+}
+#endif
+
+/* Init scheduler */
+yapos_err_t yapos_init(void)
+{
+	/* Must be called once */
+	if (init)
+		return YAPOS_ERR_WRONG_STATE;
+	init = true;
+
+	memset(&tasks_tab, 0, sizeof(tasks_tab));
+	memset(&ready_q, 0, sizeof(ready_q));
+	memset(&idle_task, 0, sizeof(idle_task));
+	yapos_curr_task = NULL;
+	yapos_next_task = NULL;
+
+#ifdef YAPOS_CONF_CCMFUNC_LOCK
+	ccmfunc_lock();
+#endif
+#ifdef YAPOS_CONF_IRQ_VECTORS
+	vectors_relocate();
+#endif
+
+	task_setup(&idle_task, &idle_handler, NULL, idle_stack,
+			YAPOS_CONF_IDLE_STACK_SIZE, YAPOS_PRIO_IDLE);
+#ifdef YAPOS_CONF_MPU
+	mpu_task_setup(&idle_task, idle_stack, YAPOS_CONF_IDLE_STACK_SIZE, NULL);
+#endif
+
+	/* Create the statically defined tasks */
+	for (const struct yapos_task_def *p_def = __yapos_tasks_start;
+			p_def < __yapos_tasks_end; p_def++) {
+		yapos_err_t err_code = task_create(&p_def->attr, p_def->p_task);
+		if (err_code != YAPOS_ERR_OK)
+			return err_code;
+	}
+
+	return YAPOS_ERR_OK;
+}
+
+/* Create task in a free slot of the tasks table, running right away if
+   the scheduler runs and the task has a higher priority than the caller */
+static yapos_err_t task_create(const struct yapos_task_attr *p_attr,
+		yapos_task_t *p_task)
+{
+	if (p_attr == NULL || p_attr->handler == NULL || p_attr->stack == NULL)
+		return YAPOS_ERR_INVALID_PARAM;
+
+	/* The lowest level is reserved for the idle task */
+	if (p_attr->prio == YAPOS_PRIO_IDLE ||
+			p_attr->prio >= YAPOS_CONF_PRIO_LEVELS)
+		return YAPOS_ERR_INVALID_PARAM;
+
+#ifdef YAPOS_CONF_MPU
+	const struct yapos_task_mpu *p_mpu = p_attr->p_mpu;
+	if (!mpu_region_valid(p_attr->stack, p_attr->stack_size*4) ||
+			p_attr->stack_size*4 < 2*MPU_GUARD_SIZE)
+		return YAPOS_ERR_INVALID_PARAM;
+	if (p_mpu != NULL &&
+			((p_mpu->data.size != 0 &&
+			  !mpu_region_valid(p_mpu->data.base, p_mpu->data.size)) ||
+			 (p_mpu->periph.size != 0 &&
+			  !mpu_region_valid(p_mpu->periph.base, p_mpu->periph.size))))
+		return YAPOS_ERR_INVALID_PARAM;
+#endif
+
+	/* Reuse the slot of a deleted task, if any */
+	uint32_t slot = 0;
+	while (slot < tasks_tab.size && tasks_tab.tasks[slot].state != TASK_FREE)
+		slot++;
+	if (slot >= YAPOS_CONF_MAX_TASKS)
+		return YAPOS_ERR_NO_MEM;
+	if (slot == tasks_tab.size)
+		tasks_tab.size++;
+
+	struct task *p_new = &tasks_tab.tasks[slot];
+	memset(p_new, 0, sizeof(*p_new));
+	task_setup(p_new, p_attr->handler, p_attr->params, p_attr->stack,
+			p_attr->stack_size, p_attr->prio);
+	p_new->slice = p_attr->slice != 0 ? p_attr->slice : YAPOS_CONF_TIME_SLICE;
+	p_new->slice_left = p_new->slice;
+#ifdef YAPOS_CONF_MPU
+	mpu_task_setup(p_new, p_attr->stack, p_attr->stack_size, p_mpu);
+#endif
+
+	if (p_task != NULL)
+		*p_task = (yapos_task_t)p_new;
+
+	if (yapos_curr_task != NULL)
+		schedule(YAPOS_SWITCH_PREEMPTED);
+
+	return YAPOS_ERR_OK;
+}
+
+/* Register new task with default priority */
+yapos_err_t yapos_add_task(void (*handler)(void *params), void *params,
+		uint32_t *stack, size_t stack_size)
+{
+	return yapos_add_task_ex(handler, params, stack, stack_size,
+			YAPOS_PRIO_DEFAULT);
+}
+
+/* Register new task with given priority */
+yapos_err_t yapos_add_task_ex(void (*handler)(void *params), void *params,
+		uint32_t *stack, size_t stack_size, uint8_t prio)
+{
+	return yapos_add_task_mpu(handler, params, stack, stack_size, prio, NULL);
+}
+
+/* Register new task with given priority and memory regions it can access
+   besides its stack (ignored without YAPOS_CONF_MPU, p_mpu can be NULL) */
+yapos_err_t yapos_add_task_mpu(void (*handler)(void *params), void *params,
+		uint32_t *stack, size_t stack_size, uint8_t prio,
+		const struct yapos_task_mpu *p_mpu)
+{
+	struct yapos_task_attr attr = {
+		.handler = handler,
+		.params = params,
+		.stack = stack,
+		.stack_size = stack_size,
+		.prio = prio,
+		.p_mpu = p_mpu,
+	};
+
+	return yapos_task_create(&attr, NULL);
+}
+
+/* Create task, before or after the scheduler started, and get its handle
+   (p_task can be NULL). The stack has to stay allocated until the task is
+   deleted. */
+yapos_err_t yapos_task_create(const struct yapos_task_attr *p_attr,
+		yapos_task_t *p_task)
+{
+	/* Must be already initialized */
+	if (!init)
+		return YAPOS_ERR_WRONG_STATE;
+
+	/* Before yapos_start(), kernel data is still accessible */
+	if (yapos_curr_task == NULL)
+		return task_create(p_attr, p_task);
+
+	/* Must be called by a task */
+	if (__get_IPSR() != 0)
+		return YAPOS_ERR_WRONG_STATE;
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_TASK_CREATE, p_attr, p_task, 0);
+}
+
+/* Terminate the calling task with the given value for yapos_task_join(),
+   the slot of the task is freed by yapos_task_delete() */
+void yapos_task_exit(void *retval)
+{
+	/* Must be called by a task */
+	if (__get_IPSR() == 0 && yapos_curr_task != NULL)
+		SVC_CALL(YAPOS_SVC_TASK_EXIT, retval, 0, 0);
+
+	while (1);
+}
+
+/* Wait for task to exit, blocking the calling task for up to timeout ticks
+   (0 does not block, YAPOS_WAIT_FOREVER never expires), and get the value
+   it exited with (p_retval can be NULL) */
+yapos_err_t yapos_task_join(yapos_task_t task, void **p_retval,
+		uint32_t timeout)
+{
+	/* Must be called by a task */
+	if (__get_IPSR() != 0 || yapos_curr_task == NULL)
+		return YAPOS_ERR_WRONG_STATE;
+	if (task == NULL)
+		return YAPOS_ERR_INVALID_PARAM;
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_TASK_JOIN, task, p_retval,
+			timeout);
+}
+
+/* Delete task (exited or not, the calling task itself included) and free
+   its slot of the tasks table for a new task. Its handle becomes invalid.
+   Fails with YAPOS_ERR_WRONG_STATE while the task owns mutexes. */
+yapos_err_t yapos_task_delete(yapos_task_t task)
+{
+	if (!init || task == NULL)
+		return YAPOS_ERR_INVALID_PARAM;
+
+	/* Before yapos_start(), kernel data is still accessible */
+	if (yapos_curr_task == NULL)
+		return task_delete((struct task *)task);
+
+	/* Must be called by a task */
+	if (__get_IPSR() != 0)
+		return YAPOS_ERR_WRONG_STATE;
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_TASK_DELETE, task, 0, 0);
+}
+
+/* Start scheduler */
+yapos_err_t yapos_start(uint32_t systick_ticks)
+{
+	/* Must be already initialized and have something to run */
+	if (!init || tasks_tab.size == 0)
+		return YAPOS_ERR_WRONG_STATE;
+
+	/* Start the SysTick timer (which sets its priority to the lowest) */
+	tick_period = systick_ticks;
+	uint32_t ret_val = SysTick_Config(systick_ticks);
+	if (ret_val != 0)
+		return YAPOS_ERR_INVALID_PARAM;
+
+	NVIC_SetPriority(PendSV_IRQn, YAPOS_CONF_PENDSV_PRIO);
+	NVIC_SetPriority(SysTick_IRQn, YAPOS_CONF_SYSTICK_PRIO);
+#ifdef YAPOS_CONF_MAX_SYSCALL_PRIO
+	/* Strictly above the kernel masking level, so that a task inside a
+	   critical section can still leave it through a supervisor call, and
+	   below the interrupts which do not call the kernel. No interrupt
+	   calling it may preempt supervisor calls. */
+	NVIC_SetPriority(SVCall_IRQn, YAPOS_CONF_MAX_SYSCALL_PRIO - 1);
+#endif
+
+#if (__FPU_USED == 1)
+	/* ASPEN: a task gets an FP context on its first FP instruction, tasks
+	   that never use the FPU keep the basic exception frame.
+	   LSPEN: on exception entry S0-S15 are only reserved in the frame and
+	   are stacked when (and if) the handler touches the FPU. */
+	FPU->FPCCR |= FPU_FPCCR_ASPEN_Msk | FPU_FPCCR_LSPEN_Msk;
+#endif
+
+	/* Start the highest priority task */
+	yapos_curr_task = ready_highest();
+	yapos_next_task = yapos_curr_task;
+
+#ifdef YAPOS_CONF_TASK_STATS
+	/* Start the cycle counter used for run time accounting */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	stats_task = (struct task *)yapos_curr_task;
+	stats_stamp = DWT->CYCCNT;
+#endif
+
+#ifdef YAPOS_CONF_MPU
+	mpu_start((struct task *)yapos_curr_task);
+#endif
+
+	/* Set PSP to the top of task's stack */
+	__set_PSP(yapos_curr_task->sp + CTX_WORDS*4);
+#ifdef YAPOS_CONF_PRIVILEGED_TASKS
+	/* Switch to Privileged Thread Mode with PSP */
+	__set_CONTROL(0x02);
+#else
+	/* Switch to Unprivileged Thread Mode with PSP */
+	__set_CONTROL(0x03);
+#endif
+	/* Execute ISB after changing CONTORL (recommended) */
+	__ISB();
+
+	/* Call first task handler, which is not entered through an exception
+	   return: finish it here as its LR (task_finished) would */
+	yapos_curr_task->handler(yapos_curr_task->params);
+	task_finished();
+
+	/* Never reached */
+	return YAPOS_ERR_OK;
+}
+
+/* Systick interrupt handler */
+void KERNEL_CCMFUNC SysTick_Handler(void)
+{
+#ifdef YAPOS_CONF_TASK_STATS
+	uint32_t start = DWT->CYCCNT;
+#endif
+
+	/* Interrupts calling the _from_isr API may preempt the tick
+	   (supervisor calls cannot) */
+	uint32_t state = kernel_lock();
+
+	uint32_t elapsed = 1;
+#ifdef YAPOS_CONF_TICKLESS
+	elapsed = tickless_exit();
+#endif
+
+	/* Update kernel time and wake up tasks whose timeout expired */
+	bool woken = tick_advance(elapsed);
+
+	/* A woken task only matters if it preempts the task PendSV_Handler
+	   runs next (which nothing but PendSV_Handler changes meanwhile) */
+	struct task *p_curr = (struct task *)yapos_curr_task;
+	bool reschedule = woken &&
+			ready_highest()->prio > yapos_next_task->prio;
+
+#ifdef YAPOS_CONF_TICKLESS
+	/* The idle task is rescheduled on every tick, to suppress the next
+	   ones */
+	if (p_curr == &idle_task)
+		reschedule = true;
+#endif
+
+#ifndef YAPOS_CONF_COOPERATIVE
+	/* Charge the running task's time slice, round-robin once expired if
+	   it has peers (a new slice otherwise) */
+	if (p_curr != &idle_task) {
+		if (p_curr->slice_left > elapsed) {
+			p_curr->slice_left -= elapsed;
+#ifdef YAPOS_CONF_TASK_STATS
+			if (p_curr->next != p_curr)
+				avoided_switches++;
+#endif
+		} else if (p_curr->next != p_curr) {
+			p_curr->slice_left = 0;
+			yapos_deferred |= DEFERRED_TICK;
+			reschedule = true;
+		} else {
+			p_curr->slice_left = p_curr->slice;
+		}
+	}
+#endif
+
+	/* Round-robin and task selection are left to PendSV_Handler, which
+	   the tick may have preempted in the middle of a switch. PendSV is
+	   only triggered if the running task may have to be switched. */
+	if (reschedule)
+		schedule(YAPOS_SWITCH_PREEMPTED);
+
+#ifdef YAPOS_CONF_TASK_STATS
+	tick_stats.count++;
+	if (reschedule)
+		tick_stats.pendsv++;
+	tick_stats.cycles += DWT->CYCCNT - start;
+#endif
+
+	kernel_unlock(state);
+}
+
+/* Give up the CPU to the other ready tasks of the same priority (or to
+   higher priority ones made ready meanwhile in cooperative mode) */
+void yapos_yield(void)
+{
+	/* Must be called by a task, once the scheduler started */
+	if (__get_IPSR() != 0 || yapos_curr_task == NULL)
+		return;
+
+	SVC_CALL(YAPOS_SVC_YIELD, 0, 0, 0);
+}
+
+/* Block the calling task for the given number of ticks */
+void yapos_sleep_ticks(uint32_t delay)
+{
+	/* Must be called by a task, once the scheduler started */
+	if (__get_IPSR() != 0 || yapos_curr_task == NULL)
+		return;
+
+	SVC_CALL(YAPOS_SVC_SLEEP, delay, 0, 0);
+}
+
+/* Block the calling task until period ticks after the previous release
+   time, which is updated (initialize it with yapos_get_ticks()) */
+void yapos_sleep_until(uint32_t *p_last_wake, uint32_t period)
+{
+	/* Must be called by a task, once the scheduler started */
+	if (__get_IPSR() != 0 || yapos_curr_task == NULL)
+		return;
+
+	SVC_CALL(YAPOS_SVC_SLEEP_UNTIL, p_last_wake, period, 0);
+}
+
+/* Get number of ticks since the scheduler started */
+uint32_t yapos_get_ticks(void)
+{
+#ifdef YAPOS_CONF_MPU
+	/* Kernel data is not accessible to unprivileged tasks */
+	if (!is_privileged())
+		return SVC_CALL(YAPOS_SVC_GET_TICKS, 0, 0, 0);
+#endif
+
+	return ticks;
+}
+
+/* Mask the interrupts allowed to call the kernel, all of them without
+   YAPOS_CONF_MAX_SYSCALL_PRIO (which tasks cannot do by themselves when
+   running unprivileged), and store the previous state for
+   yapos_irq_unlock(). Unprivileged tasks can only do it with BASEPRI:
+   PRIMASK would also mask the supervisor call restoring it. */
+yapos_err_t yapos_irq_lock(uint32_t *p_state)
+{
+	if (!is_privileged()) {
+#ifdef KERNEL_BASEPRI
+		*p_state = SVC_CALL(YAPOS_SVC_IRQ_LOCK, 0, 0, 0);
+		return YAPOS_ERR_OK;
+#else
+		return YAPOS_ERR_WRONG_STATE;
+#endif
+	}
+
+	*p_state = kernel_lock();
+
+	return YAPOS_ERR_OK;
+}
+
+/* Restore the interrupt state stored by yapos_irq_lock() */
+yapos_err_t yapos_irq_unlock(uint32_t state)
+{
+	if (!is_privileged()) {
+#ifdef KERNEL_BASEPRI
+		SVC_CALL(YAPOS_SVC_IRQ_UNLOCK, state, 0, 0);
+		return YAPOS_ERR_OK;
+#else
+		return YAPOS_ERR_WRONG_STATE;
+#endif
+	}
+
+	kernel_unlock(state);
+
+	return YAPOS_ERR_OK;
+}
+
+/* Enable interrupt line in the NVIC */
+yapos_err_t yapos_irq_enable(IRQn_Type irqn)
+{
+	if (!is_privileged())
+		return (yapos_err_t)SVC_CALL(YAPOS_SVC_IRQ_ENABLE, irqn, 0, 0);
+
+	return (yapos_err_t)svc_irq_enable(irqn, 0, 0, 0);
+}
+
+/* Install the handler of an interrupt line in the vector table relocated
+   to RAM, set its priority and enable it (after yapos_init()) */
+yapos_err_t yapos_irq_attach(IRQn_Type irqn, void (*handler)(void),
+		uint32_t prio)
+{
+	if (!is_privileged()) {
+#ifdef YAPOS_CONF_MPU
+		/* The handler would run privileged */
+		return YAPOS_ERR_WRONG_STATE;
+#else
+		return (yapos_err_t)SVC_CALL(YAPOS_SVC_IRQ_ATTACH, irqn, handler,
+				prio);
+#endif
+	}
+
+	return irq_attach(irqn, handler, prio);
+}
+
+/* Disable interrupt line in the NVIC */
+yapos_err_t yapos_irq_disable(IRQn_Type irqn)
+{
+	if (!is_privileged())
+		return (yapos_err_t)SVC_CALL(YAPOS_SVC_IRQ_DISABLE, irqn, 0, 0);
+
+	return (yapos_err_t)svc_irq_disable(irqn, 0, 0, 0);
+}
+
+/* Initialize semaphore with count tokens available out of max */
+yapos_err_t yapos_sem_init(struct yapos_sem *p_sem, uint32_t count,
+		uint32_t max)
+{
+	if (p_sem == NULL || max == 0 || count > max)
+		return YAPOS_ERR_INVALID_PARAM;
+
+	p_sem->count = count;
+	p_sem->max = max;
+	p_sem->wait.head = NULL;
+
+	return YAPOS_ERR_OK;
+}
+
+/* Take semaphore, blocking the calling task for up to timeout ticks when
+   none is available (0 does not block, YAPOS_WAIT_FOREVER never expires) */
+yapos_err_t yapos_sem_take(struct yapos_sem *p_sem, uint32_t timeout)
+{
+	/* Must be called by a task, once the scheduler started */
+	if (__get_IPSR() != 0 || yapos_curr_task == NULL)
+		return YAPOS_ERR_WRONG_STATE;
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_SEM_TAKE, p_sem, timeout, 0);
+}
+
+/* Give semaphore from a task, the waiter preempts the caller if it has
+   a higher priority */
+yapos_err_t yapos_sem_give(struct yapos_sem *p_sem)
+{
+	/* Must be called by a task, or by main() before yapos_start() */
+	if (__get_IPSR() != 0)
+		return YAPOS_ERR_WRONG_STATE;
+
+	/* Directly before yapos_start() */
+	if (yapos_curr_task == NULL)
+		return (yapos_err_t)svc_direct(&svc_sem_give, (uint32_t)p_sem, 0, 0);
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_SEM_GIVE, p_sem, 0, 0);
+}
+
+/* Give semaphore from an interrupt handler, the waiter is switched to by
+   PendSV when the interrupts return */
+yapos_err_t yapos_sem_give_from_isr(struct yapos_sem *p_sem)
+{
+	uint32_t state = kernel_lock();
+
+	yapos_err_t err_code = sem_give(p_sem);
+
+	kernel_unlock(state);
+
+	return err_code;
+}
+
+/* Initialize mutex, unlocked */
+yapos_err_t yapos_mutex_init(struct yapos_mutex *p_mutex)
+{
+	if (p_mutex == NULL)
+		return YAPOS_ERR_INVALID_PARAM;
+
+	p_mutex->owner = 0;
+	p_mutex->count = 0;
+	p_mutex->wait.head = NULL;
+	p_mutex->next = NULL;
+
+	return YAPOS_ERR_OK;
+}
+
+/* Lock mutex, blocking the calling task for up to timeout ticks while
+   another task owns it (0 does not block, YAPOS_WAIT_FOREVER never
+   expires). The owning task can lock it again, it is released when
+   unlocked as many times. */
+yapos_err_t yapos_mutex_lock(struct yapos_mutex *p_mutex, uint32_t timeout)
+{
+	/* Must be called by a task */
+	if (__get_IPSR() != 0 || yapos_curr_task == NULL)
+		return YAPOS_ERR_WRONG_STATE;
+
+#ifdef YAPOS_PORT_ARMV7M
+	/* Fast path without supervisor call: take the mutex if free or nest
+	   the lock (an exception in between makes the store fail). It updates
+	   the task, not accessible with YAPOS_CONF_MPU to unprivileged ones. */
+#ifdef YAPOS_CONF_MPU
+	if (!is_privileged())
+		return (yapos_err_t)SVC_CALL(YAPOS_SVC_MUTEX_LOCK, p_mutex, timeout,
+				0);
+#endif
+	struct task *p_curr = (struct task *)yapos_curr_task;
+	uint32_t self = (uint32_t)p_curr;
+	uint32_t owner;
+	/* Counted first, so that the task is never seen owning more mutexes
+	   than counted (see task_delete()) */
+	p_curr->mutexes++;
+	do {
+		owner = __LDREXW(&p_mutex->owner);
+		if (owner != 0) {
+			__CLREX();
+			break;
+		}
+	} while (__STREXW(self, &p_mutex->owner) != 0);
+
+	if (owner == 0) {
+		p_mutex->count = 1;
+		return YAPOS_ERR_OK;
+	}
+	p_curr->mutexes--;
+	if ((owner & ~MUTEX_WAITERS) == self) {
+		p_mutex->count++;
+		return YAPOS_ERR_OK;
+	}
+#endif
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_MUTEX_LOCK, p_mutex, timeout, 0);
+}
+
+/* Unlock mutex owned by the calling task */
+yapos_err_t yapos_mutex_unlock(struct yapos_mutex *p_mutex)
+{
+	/* Must be called by a task */
+	if (__get_IPSR() != 0 || yapos_curr_task == NULL)
+		return YAPOS_ERR_WRONG_STATE;
+
+#ifdef YAPOS_PORT_ARMV7M
+	/* Fast path without supervisor call: nested lock, or nobody waiting
+	   for the mutex (see yapos_mutex_lock()) */
+#ifdef YAPOS_CONF_MPU
+	if (!is_privileged())
+		return (yapos_err_t)SVC_CALL(YAPOS_SVC_MUTEX_UNLOCK, p_mutex, 0, 0);
+#endif
+	struct task *p_curr = (struct task *)yapos_curr_task;
+	uint32_t self = (uint32_t)p_curr;
+	if ((p_mutex->owner & ~MUTEX_WAITERS) != self)
+		return YAPOS_ERR_WRONG_STATE;
+
+	if (p_mutex->count > 1) {
+		p_mutex->count--;
+		return YAPOS_ERR_OK;
+	}
+
+	uint32_t owner;
+	do {
+		owner = __LDREXW(&p_mutex->owner);
+		if (owner != self) {
+			__CLREX();
+			break;
+		}
+	} while (__STREXW(0, &p_mutex->owner) != 0);
+
+	if (owner == self) {
+		p_curr->mutexes--;
+		return YAPOS_ERR_OK;
+	}
+#endif
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_MUTEX_UNLOCK, p_mutex, 0, 0);
+}
+
+/* Initialize queue of capacity messages of msg_size bytes, stored in the
+   given array (of capacity*msg_size bytes) */
+yapos_err_t yapos_queue_init(struct yapos_queue *p_queue, void *storage,
+		size_t msg_size, size_t capacity)
+{
+	if (p_queue == NULL || storage == NULL || capacity == 0)
+		return YAPOS_ERR_INVALID_PARAM;
+
+	p_queue->buf = storage;
+	p_queue->msg_size = msg_size;
+	p_queue->capacity = capacity;
+	p_queue->head = 0;
+	p_queue->count = 0;
+	p_queue->recv_wait.head = NULL;
+	p_queue->send_wait.head = NULL;
+
+	return YAPOS_ERR_OK;
+}
+
+/* Initialize queue in pointer mode, passing buffer pointers instead of
+   copying messages (zero-copy): p_msg of send is the message itself and
+   receive stores it to *(void **)p_msg. The buffers are owned by the
+   receiver until it hands them back. */
+yapos_err_t yapos_queue_init_ptr(struct yapos_queue *p_queue, void **storage,
+		size_t capacity)
+{
+	return yapos_queue_init(p_queue, storage, 0, capacity);
+}
+
+/* Send message, blocking the calling task for up to timeout ticks while
+   the queue is full (0 does not block, YAPOS_WAIT_FOREVER never expires) */
+yapos_err_t yapos_queue_send(struct yapos_queue *p_queue, const void *p_msg,
+		uint32_t timeout)
+{
+	/* Must be called by a task, or by main() before yapos_start() */
+	if (__get_IPSR() != 0)
+		return YAPOS_ERR_WRONG_STATE;
+
+	/* Directly before yapos_start() (without waiting for room) */
+	if (yapos_curr_task == NULL)
+		return (yapos_err_t)svc_direct(&svc_queue_send,
+				(uint32_t)p_queue, (uint32_t)p_msg, 0);
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_QUEUE_SEND, p_queue, p_msg,
+			timeout);
+}
+
+/* Receive the oldest message, blocking the calling task for up to timeout
+   ticks while the queue is empty */
+yapos_err_t yapos_queue_receive(struct yapos_queue *p_queue, void *p_msg,
+		uint32_t timeout)
+{
+	/* Must be called by a task, once the scheduler started */
+	if (__get_IPSR() != 0 || yapos_curr_task == NULL)
+		return YAPOS_ERR_WRONG_STATE;
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_QUEUE_RECEIVE, p_queue, p_msg,
+			timeout);
+}
+
+/* Send message from an interrupt handler, YAPOS_ERR_TIMEOUT if the queue
+   is full */
+yapos_err_t yapos_queue_send_from_isr(struct yapos_queue *p_queue,
+		const void *p_msg)
+{
+	uint32_t state = kernel_lock();
+
+	yapos_err_t err_code = queue_send(p_queue, p_msg);
+
+	kernel_unlock(state);
+
+	return err_code;
+}
+
+/* Receive message from an interrupt handler, YAPOS_ERR_TIMEOUT if the
+   queue is empty */
+yapos_err_t yapos_queue_receive_from_isr(struct yapos_queue *p_queue,
+		void *p_msg)
+{
+	uint32_t state = kernel_lock();
+
+	yapos_err_t err_code = queue_receive(p_queue, p_msg);
+
+	kernel_unlock(state);
+
+	return err_code;
+}
+
+/* Initialize event group with the given flags set */
+yapos_err_t yapos_event_init(struct yapos_event *p_event, uint32_t flags)
+{
+	if (p_event == NULL)
+		return YAPOS_ERR_INVALID_PARAM;
+
+	p_event->flags = flags;
+	p_event->wait.head = NULL;
+	p_event->next = NULL;
+	p_event->pending = false;
+
+	return YAPOS_ERR_OK;
+}
+
+/* Set flags of event group from a task, the satisfied waiters are woken up
+   by PendSV right after */
+yapos_err_t yapos_event_set(struct yapos_event *p_event, uint32_t flags)
+{
+	/* Must be called by a task, or by main() before yapos_start() */
+	if (__get_IPSR() != 0)
+		return YAPOS_ERR_WRONG_STATE;
+
+	/* Directly before yapos_start() */
+	if (yapos_curr_task == NULL)
+		return (yapos_err_t)svc_direct(&svc_event_set,
+				(uint32_t)p_event, flags, 0);
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_EVENT_SET, p_event, flags, 0);
+}
+
+/* Set flags of event group from an interrupt handler, in constant time */
+yapos_err_t yapos_event_set_from_isr(struct yapos_event *p_event,
+		uint32_t flags)
+{
+	uint32_t state = kernel_lock();
+
+	event_set(p_event, flags);
+
+	kernel_unlock(state);
+
+	return YAPOS_ERR_OK;
+}
+
+/* Clear flags of event group, from a task or an interrupt handler */
+yapos_err_t yapos_event_clear(struct yapos_event *p_event, uint32_t flags)
+{
+#ifdef YAPOS_CONF_MPU
+	/* A group outside the regions of the task is refused by the
+	   supervisor call instead of faulting */
+	if (!is_privileged())
+		return (yapos_err_t)SVC_CALL(YAPOS_SVC_EVENT_CLEAR, p_event, flags,
+				0);
+#endif
+
+#ifdef YAPOS_PORT_ARMV7M
+	/* The kernel modifies flags with interrupts masked, an exception in
+	   between makes the store fail */
+	uint32_t value;
+	do {
+		value = __LDREXW(&p_event->flags);
+	} while (__STREXW(value & ~flags, &p_event->flags) != 0);
+#else
+	/* Unprivileged tasks cannot mask interrupts (see yapos_irq_lock()) */
+	if (!is_privileged())
+		return (yapos_err_t)SVC_CALL(YAPOS_SVC_EVENT_CLEAR, p_event, flags,
+				0);
+
+	svc_event_clear((uint32_t)p_event, flags, 0, 0);
+#endif
+
+	return YAPOS_ERR_OK;
+}
+
+/* Get flags of event group */
+uint32_t yapos_event_get(const struct yapos_event *p_event)
+{
+#ifdef YAPOS_CONF_MPU
+	/* A group outside the regions of the task is refused by the
+	   supervisor call instead of faulting */
+	if (!is_privileged())
+		return SVC_CALL(YAPOS_SVC_EVENT_GET, p_event, 0, 0);
+#endif
+
+	return p_event->flags;
+}
+
+/* Wait for any or all (options YAPOS_EVENT_ANY/ALL) of the flags of mask
+   to be set, blocking the calling task for up to timeout ticks (0 does not
+   block, YAPOS_WAIT_FOREVER never expires). With YAPOS_EVENT_CLEAR the
+   matched flags are cleared. Return the flags of the group which satisfied
+   the wait, 0 on timeout. */
+uint32_t yapos_event_wait(struct yapos_event *p_event, uint32_t mask,
+		uint32_t options, uint32_t timeout)
+{
+	/* Must be called by a task, once the scheduler started */
+	if (__get_IPSR() != 0 || yapos_curr_task == NULL || mask == 0)
+		return 0;
+
+	return SVC_CALL4(YAPOS_SVC_EVENT_WAIT, p_event, mask, options, timeout);
+}
+
+/* Get handle of the calling task */
+yapos_task_t yapos_task_self(void)
+{
+	return (yapos_task_t)yapos_curr_task;
+}
+
+/* Notify task from a task: update its notification word (see
+   yapos_notify_action_t) and wake it up if waiting for it */
+yapos_err_t yapos_notify(yapos_task_t task, uint32_t value,
+		yapos_notify_action_t action)
+{
+	/* Must be called by a task, or by main() before yapos_start() */
+	if (__get_IPSR() != 0)
+		return YAPOS_ERR_WRONG_STATE;
+	if (task == NULL)
+		return YAPOS_ERR_INVALID_PARAM;
+
+	/* Directly before yapos_start() */
+	if (yapos_curr_task == NULL)
+		return (yapos_err_t)svc_direct(&svc_notify, (uint32_t)task,
+				value, action);
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_NOTIFY, task, value, action);
+}
+
+/* Notify task from an interrupt handler, no kernel object involved */
+yapos_err_t yapos_notify_from_isr(yapos_task_t task, uint32_t value,
+		yapos_notify_action_t action)
+{
+	if (task == NULL)
+		return YAPOS_ERR_INVALID_PARAM;
+
+	uint32_t state = kernel_lock();
+
+	task_notify((struct task *)task, value, action);
+
+	kernel_unlock(state);
+
+	return YAPOS_ERR_OK;
+}
+
+/* Wait for a notification of the calling task, blocking it for up to
+   timeout ticks (0 does not block, YAPOS_WAIT_FOREVER never expires).
+   The value of the notification word is stored to p_value (if not NULL),
+   then the flags of clear are cleared in it (UINT32_MAX resets it). */
+yapos_err_t yapos_notify_wait(uint32_t clear, uint32_t *p_value,
+		uint32_t timeout)
+{
+	/* Must be called by a task, once the scheduler started */
+	if (__get_IPSR() != 0 || yapos_curr_task == NULL)
+		return YAPOS_ERR_WRONG_STATE;
+
+	return (yapos_err_t)SVC_CALL(YAPOS_SVC_NOTIFY_WAIT, clear, p_value,
+			timeout);
+}
+
+/* Get number of ticks suppressed by the tickless idle mode */
+uint32_t yapos_get_suppressed_ticks(void)
+{
+#ifdef YAPOS_CONF_TICKLESS
+	return suppressed_ticks;
+#else
+	return 0;
+#endif
+}
+
+/* Get number of ticks on which the running task kept the CPU, within its
+   time slice, while other tasks of its priority were ready */
+uint32_t yapos_get_avoided_switches(void)
+{
+#ifdef YAPOS_CONF_TASK_STATS
+	return avoided_switches;
+#else
+	return 0;
+#endif
+}
+
+/* Get the cost of the tick: number of SysTick interrupts, cycles spent
+   handling them and number of them which triggered PendSV */
+yapos_err_t yapos_get_tick_stats(struct yapos_tick_stats *p_stats)
+{
+#ifdef YAPOS_CONF_MPU
+	/* Kernel data is not accessible to unprivileged tasks */
+	if (!is_privileged())
+		return (yapos_err_t)SVC_CALL(YAPOS_SVC_GET_TICK_STATS, p_stats,
+				0, 0);
+#endif
+
+	return tick_stats_get(p_stats);
+}
+
+/* Get number of stack words never used by the task owning the stack */
+size_t yapos_stack_unused(const uint32_t *stack, size_t stack_size)
+{
+	size_t unused = 0;
+
+#ifdef YAPOS_CONF_STACK_CHECK
+	while (unused < stack_size && stack[unused] == STACK_FILL)
+		unused++;
+#else
+	(void)stack;
+	(void)stack_size;
+#endif
+
+	return unused;
+}
+
+/* Get run time statistics of the tasks (see task_stats_get()) */
+yapos_err_t yapos_get_task_stats(struct yapos_task_stats *p_stats,
+		size_t *p_count, struct yapos_task_stats *p_idle)
+{
+#ifdef YAPOS_CONF_MPU
+	/* Kernel data is not accessible to unprivileged tasks */
+	if (!is_privileged())
+		return (yapos_err_t)SVC_CALL(YAPOS_SVC_GET_TASK_STATS, p_stats,
+				p_count, p_idle);
+#endif
 
-	/* Trigger PendSV which performs the actual context switch */
-	SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk;
+	return task_stats_get(p_stats, p_count, p_idle);
 }
@@ -6,17 +6,340 @@
 #include <string.h>
 
 #include "yapos_config.h"
+#include "yapos_port.h"
+
+/* Number of task priority levels (0 is the lowest priority) */
+#ifndef YAPOS_CONF_PRIO_LEVELS
+#define YAPOS_CONF_PRIO_LEVELS	8
+#endif
+
+#if YAPOS_CONF_PRIO_LEVELS < 2 || YAPOS_CONF_PRIO_LEVELS > 32
+#error "YAPOS_CONF_PRIO_LEVELS must be in range 2..32"
+#endif
+
+/* Stack size of the idle task (in 32-bit words) */
+#ifndef YAPOS_CONF_IDLE_STACK_SIZE
+#define YAPOS_CONF_IDLE_STACK_SIZE	64
+#endif
+
+/* Length of the (tumbling) run time statistics window (in ticks) */
+#ifndef YAPOS_CONF_STATS_WINDOW
+#define YAPOS_CONF_STATS_WINDOW	1000
+#endif
+
+/* Default time slice (in ticks) */
+#ifndef YAPOS_CONF_TIME_SLICE
+#define YAPOS_CONF_TIME_SLICE	1
+#endif
+
+/* SysTick and PendSV priorities, the lowest one by default */
+#ifndef YAPOS_CONF_SYSTICK_PRIO
+#define YAPOS_CONF_SYSTICK_PRIO	((1 << __NVIC_PRIO_BITS) - 1)
+#endif
+
+#ifndef YAPOS_CONF_PENDSV_PRIO
+#define YAPOS_CONF_PENDSV_PRIO	((1 << __NVIC_PRIO_BITS) - 1)
+#endif
+
+/* Alignment of task stacks, to their size with YAPOS_CONF_MPU */
+#ifdef YAPOS_CONF_MPU
+#define YAPOS_STACK_ALIGN(stack_words)	__attribute__((aligned((stack_words)*4)))
+#else
+#define YAPOS_STACK_ALIGN(stack_words)	__attribute__((aligned(8)))
+#endif
+
+/* Place a variable in CCM SRAM with YAPOS_CONF_CCM (not initialised, not
+   reachable by DMA), e.g. the stack of a task created at run time. With
+   YAPOS_CONF_MPU, unprivileged tasks only reach it through their own
+   regions. */
+#ifdef YAPOS_CONF_CCM
+#define YAPOS_CCM	__attribute__((section(".yapos_ccm")))
+#else
+#define YAPOS_CCM
+#endif
+
+/* Execute a function from CCM SRAM with YAPOS_CONF_CCMFUNC (copied there
+   by the startup code), e.g. an interrupt handler on a hot path. Calls
+   between it and flash go through linker veneers. With YAPOS_CONF_MPU,
+   only privileged code may execute it. */
+#ifdef YAPOS_CONF_CCMFUNC
+#define YAPOS_CCMFUNC	__attribute__((section(".ccmfunc")))
+#else
+#define YAPOS_CCMFUNC
+#endif
+
+/* Critical section in a task or an interrupt handler, nestable (the
+   previous state is restored): masks the interrupts allowed to call the
+   kernel (see YAPOS_CONF_MAX_SYSCALL_PRIO), which must not be called
+   inside. Both must be used in the same block. Unprivileged tasks can only
+   mask interrupts with BASEPRI (ARMv7-M and YAPOS_CONF_MAX_SYSCALL_PRIO):
+   otherwise using the macros is a build error, interrupt handlers can
+   call yapos_irq_lock() and yapos_irq_unlock() instead. */
+#if defined(YAPOS_CONF_PRIVILEGED_TASKS) || \
+	(defined(YAPOS_PORT_BASEPRI) && defined(YAPOS_CONF_MAX_SYSCALL_PRIO))
+#define yapos_enter_critical() \
+	do { uint32_t yapos_critical_state = 0; \
+	(void)yapos_irq_lock(&yapos_critical_state)
+#define yapos_exit_critical() \
+	(void)yapos_irq_unlock(yapos_critical_state); } while (0)
+#else
+#define yapos_enter_critical() \
+	do { _Static_assert(0, "yapos_enter_critical() needs BASEPRI " \
+		"or YAPOS_CONF_PRIVILEGED_TASKS")
+#define yapos_exit_critical() \
+	} while (0)
+#endif
+
+/* Priority of the idle task, reserved for it */
+#define YAPOS_PRIO_IDLE		0
+/* Priority of tasks registered by yapos_add_task() */
+#define YAPOS_PRIO_DEFAULT	1
 
 typedef enum {
 	YAPOS_ERR_OK = 0,
 	YAPOS_ERR_WRONG_STATE,
 	YAPOS_ERR_NO_MEM,
 	YAPOS_ERR_INVALID_PARAM,
+	YAPOS_ERR_TIMEOUT,
+	YAPOS_ERR_OVERFLOW,
 } yapos_err_t;
 
+/* Timeout of blocking calls which never expires */
+#define YAPOS_WAIT_FOREVER	UINT32_MAX
+
+/* Reasons why a task is switched out */
+typedef enum {
+	YAPOS_SWITCH_PREEMPTED = 0,	/* Time slice or higher priority task */
+	YAPOS_SWITCH_YIELDED,		/* Gave up the CPU voluntarily */
+	YAPOS_SWITCH_BLOCKED,		/* Waiting (sleep, timeout, object) */
+	YAPOS_SWITCH_CAUSES
+} yapos_switch_cause_t;
+
+/* Task handle */
+typedef struct yapos_task *yapos_task_t;
+
+/* Update of the notification word of a task */
+typedef enum {
+	YAPOS_NOTIFY_SET_BITS = 0,	/* OR the value in */
+	YAPOS_NOTIFY_INCREMENT,		/* Increment by one, value ignored */
+	YAPOS_NOTIFY_OVERWRITE,		/* Replace by the value */
+} yapos_notify_action_t;
+
+/* Run time statistics of a task */
+struct yapos_task_stats {
+	void (*handler)(void *params);
+	uint8_t prio;
+	/* Share of the CPU in the last complete statistics window */
+	uint8_t cpu_percent;
+	/* Cycles spent running (wraps), asleep in WFI included for the idle
+	   task (added once per window) */
+	uint32_t cycles;
+	/* Number of times the task was switched out, by cause */
+	uint32_t switches[YAPOS_SWITCH_CAUSES];
+};
+
+/* Cost of the tick (see YAPOS_CONF_TASK_STATS) */
+struct yapos_tick_stats {
+	/* Number of SysTick interrupts */
+	uint32_t count;
+	/* Cycles spent in SysTick_Handler, exception entry and exit excluded
+	   (wraps) */
+	uint32_t cycles;
+	/* Number of SysTick interrupts which triggered PendSV */
+	uint32_t pendsv;
+};
+
+/* Memory region granted to a task (see YAPOS_CONF_MPU): size is a power
+   of two of at least 32 bytes (0 if unused) and base is aligned to it */
+struct yapos_mpu_region {
+	void *base;
+	uint32_t size;
+};
+
+/* Regions a task can access besides its stack and the code space */
+struct yapos_task_mpu {
+	struct yapos_mpu_region data;	/* Private data, read/write */
+	struct yapos_mpu_region periph;	/* Peripheral window, read/write */
+};
+
+/* Attributes of a task to be created (see yapos_task_create()) */
+struct yapos_task_attr {
+	void (*handler)(void *params);
+	void *params;
+	uint32_t *stack;
+	size_t stack_size;		/* In 32-bit words */
+	uint8_t prio;
+	const struct yapos_task_mpu *p_mpu;	/* Can be NULL */
+	uint32_t slice;		/* In ticks, 0 for YAPOS_CONF_TIME_SLICE */
+};
+
+/* Tasks blocked on a kernel object, highest priority first (kernel
+   private) */
+struct yapos_wait {
+	void *head;
+};
+
+/* Counting semaphore, a binary signal when max is 1 (kernel private, to be
+   set up by yapos_sem_init()) */
+struct yapos_sem {
+	volatile uint32_t count;
+	uint32_t max;
+	struct yapos_wait wait;
+};
+
+/* Recursive mutex with priority inheritance (kernel private, to be set up
+   by yapos_mutex_init()). The owner is the locking task (0 when free), its
+   bit 0 is set while other tasks wait for the mutex. With YAPOS_CONF_MPU
+   it must lie in a data region of every unprivileged task using it, which
+   always locks and unlocks it through a supervisor call. */
+struct yapos_mutex {
+	volatile uint32_t owner;
+	uint32_t count;
+	struct yapos_wait wait;
+	struct yapos_mutex *next;
+};
+
+/* Queue of fixed-size messages over caller-supplied storage (kernel
+   private, to be set up by yapos_queue_init() or yapos_queue_init_ptr()).
+   A message size of 0 selects the pointer mode. */
+struct yapos_queue {
+	uint8_t *buf;
+	uint32_t msg_size;
+	uint32_t capacity;
+	uint32_t head;
+	volatile uint32_t count;
+	struct yapos_wait recv_wait;
+	struct yapos_wait send_wait;
+};
+
+/* Event group wait options */
+#define YAPOS_EVENT_ANY		0x0	/* Any flag of the mask */
+#define YAPOS_EVENT_ALL		0x1	/* All flags of the mask */
+#define YAPOS_EVENT_CLEAR	0x2	/* Clear the matched flags on wakeup */
+
+/* Group of 32 event flags (kernel private, to be set up by
+   yapos_event_init()) */
+struct yapos_event {
+	volatile uint32_t flags;
+	struct yapos_wait wait;
+	/* Link in the list of groups whose waiters are to be matched */
+	struct yapos_event *next;
+	bool pending;
+};
+
+/* Task created by yapos_init() (see YAPOS_TASK_DEFINE()) */
+struct yapos_task_def {
+	struct yapos_task_attr attr;
+	yapos_task_t *p_task;
+};
+
+/* Define task created by yapos_init(), without the application calling
+   yapos_task_create(): its stack goes to section .yapos_stacks
+   (.yapos_stacks_ccm, in CCM SRAM, with YAPOS_CONF_CCM) and its attributes
+   to the table in section .yapos_tasks, all placed by linker/sections.ld.
+   yapos_init() still creates the tasks of the table one by one (in the
+   order of their names), as yapos_task_create() would. The task handle is
+   a global variable of the given name. */
+#ifdef YAPOS_CONF_CCM
+#define YAPOS_TASK_DEFINE(name, fn, task_prio, stack_words) \
+	YAPOS_TASK_DEFINE_IN(name, fn, task_prio, stack_words, \
+			".yapos_stacks_ccm.")
+#else
+#define YAPOS_TASK_DEFINE(name, fn, task_prio, stack_words) \
+	YAPOS_TASK_DEFINE_IN(name, fn, task_prio, stack_words, ".yapos_stacks.")
+#endif
+
+/* Same with the stack in SRAM in any case, for tasks which pass buffers on
+   their stack to DMA */
+#define YAPOS_TASK_DEFINE_SRAM(name, fn, task_prio, stack_words) \
+	YAPOS_TASK_DEFINE_IN(name, fn, task_prio, stack_words, ".yapos_stacks.")
+
+#define YAPOS_TASK_DEFINE_IN(name, fn, task_prio, stack_words, stack_section) \
+	static uint32_t name##_stack[stack_words] YAPOS_STACK_ALIGN(stack_words) \
+		__attribute__((section(stack_section #name))); \
+	yapos_task_t name; \
+	static const struct yapos_task_def name##_def \
+		__attribute__((section(".yapos_tasks." #name), used)) = { \
+		.attr = { \
+			.handler = (fn), \
+			.params = NULL, \
+			.stack = name##_stack, \
+			.stack_size = (stack_words), \
+			.prio = (task_prio), \
+			.p_mpu = NULL, \
+			.slice = 0, \
+		}, \
+		.p_task = &name, \
+	}
+
 yapos_err_t yapos_init(void);
 yapos_err_t yapos_add_task(void (*handler)(void *params), void *params,
 		uint32_t *stack, size_t stack_size);
+yapos_err_t yapos_add_task_ex(void (*handler)(void *params), void *params,
+		uint32_t *stack, size_t stack_size, uint8_t prio);
+yapos_err_t yapos_add_task_mpu(void (*handler)(void *params), void *params,
+		uint32_t *stack, size_t stack_size, uint8_t prio,
+		const struct yapos_task_mpu *p_mpu);
+yapos_err_t yapos_task_create(const struct yapos_task_attr *p_attr,
+		yapos_task_t *p_task);
+void yapos_task_exit(void *retval) __attribute__((noreturn));
+yapos_err_t yapos_task_join(yapos_task_t task, void **p_retval,
+		uint32_t timeout);
+yapos_err_t yapos_task_delete(yapos_task_t task);
 yapos_err_t yapos_start(uint32_t systick_ticks);
+void yapos_yield(void);
+void yapos_sleep_ticks(uint32_t delay);
+void yapos_sleep_until(uint32_t *p_last_wake, uint32_t period);
+uint32_t yapos_get_ticks(void);
+yapos_err_t yapos_irq_lock(uint32_t *p_state);
+yapos_err_t yapos_irq_unlock(uint32_t state);
+yapos_err_t yapos_irq_enable(IRQn_Type irqn);
+yapos_err_t yapos_irq_disable(IRQn_Type irqn);
+yapos_err_t yapos_irq_attach(IRQn_Type irqn, void (*handler)(void),
+		uint32_t prio);
+yapos_err_t yapos_sem_init(struct yapos_sem *p_sem, uint32_t count,
+		uint32_t max);
+yapos_err_t yapos_sem_take(struct yapos_sem *p_sem, uint32_t timeout);
+yapos_err_t yapos_sem_give(struct yapos_sem *p_sem);
+yapos_err_t yapos_sem_give_from_isr(struct yapos_sem *p_sem);
+yapos_err_t yapos_mutex_init(struct yapos_mutex *p_mutex);
+yapos_err_t yapos_mutex_lock(struct yapos_mutex *p_mutex, uint32_t timeout);
+yapos_err_t yapos_mutex_unlock(struct yapos_mutex *p_mutex);
+yapos_err_t yapos_queue_init(struct yapos_queue *p_queue, void *storage,
+		size_t msg_size, size_t capacity);
+yapos_err_t yapos_queue_init_ptr(struct yapos_queue *p_queue, void **storage,
+		size_t capacity);
+yapos_err_t yapos_queue_send(struct yapos_queue *p_queue, const void *p_msg,
+		uint32_t timeout);
+yapos_err_t yapos_queue_receive(struct yapos_queue *p_queue, void *p_msg,
+		uint32_t timeout);
+yapos_err_t yapos_queue_send_from_isr(struct yapos_queue *p_queue,
+		const void *p_msg);
+yapos_err_t yapos_queue_receive_from_isr(struct yapos_queue *p_queue,
+		void *p_msg);
+yapos_err_t yapos_event_init(struct yapos_event *p_event, uint32_t flags);
+yapos_err_t yapos_event_set(struct yapos_event *p_event, uint32_t flags);
+yapos_err_t yapos_event_set_from_isr(struct yapos_event *p_event,
+		uint32_t flags);
+yapos_err_t yapos_event_clear(struct yapos_event *p_event, uint32_t flags);
+uint32_t yapos_event_get(const struct yapos_event *p_event);
+uint32_t yapos_event_wait(struct yapos_event *p_event, uint32_t mask,
+		uint32_t options, uint32_t timeout);
+yapos_task_t yapos_task_self(void);
+yapos_err_t yapos_notify(yapos_task_t task, uint32_t value,
+		yapos_notify_action_t action);
+yapos_err_t yapos_notify_from_isr(yapos_task_t task, uint32_t value,
+		yapos_notify_action_t action);
+yapos_err_t yapos_notify_wait(uint32_t clear, uint32_t *p_value,
+		uint32_t timeout);
+uint32_t yapos_get_suppressed_ticks(void);
+uint32_t yapos_get_avoided_switches(void);
+yapos_err_t yapos_get_tick_stats(struct yapos_tick_stats *p_stats);
+yapos_err_t yapos_get_task_stats(struct yapos_task_stats *p_stats,
+		size_t *p_count, struct yapos_task_stats *p_idle);
+size_t yapos_stack_unused(const uint32_t *stack, size_t stack_size);
+
+/* Stack overflow hook, weak (see YAPOS_CONF_STACK_CHECK) */
+void yapos_stack_overflow_hook(void (*handler)(void *params), void *params);
 
 #endif
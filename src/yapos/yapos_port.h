@@ -0,0 +1,24 @@
+#ifndef YAPOS_PORT_H
+#define YAPOS_PORT_H
+
+/* Target selection shared by C and assembly sources (preprocessor only) */
+
+/* ARMv7-M (Cortex-M3/M4) context switch, the portable ARMv6-M one can be
+   forced by defining YAPOS_PENDSV_ARMV6M (compiler and assembler) */
+#if (defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)) && \
+		!defined(YAPOS_PENDSV_ARMV6M)
+#define YAPOS_PORT_ARMV7M
+#endif
+
+/* BASEPRI register (ARMv7-M, whatever the context switch), used for the
+   critical sections with YAPOS_CONF_MAX_SYSCALL_PRIO */
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#define YAPOS_PORT_BASEPRI
+#endif
+
+/* Hard-float build: the FPU registers are part of the task context */
+#if defined(__VFP_FP__) && !defined(__SOFTFP__)
+#define YAPOS_PORT_FPU
+#endif
+
+#endif
@@ -1,12 +1,107 @@
 #ifndef YAPOS_CONFIG_H
 #define YAPOS_CONFIG_H
 
-/* Include CMSIS library */
+/* Include CMSIS library (C sources only, this file is also included by
+   yapos_pendsv.S) */
+#ifndef __ASSEMBLER__
 #include <stm32f30x.h>
+#endif
 
-/* The maximum number of tasks */
+/* The maximum number of tasks existing at the same time, the idle task
+   excluded (slots of deleted tasks are reused) */
 #define YAPOS_CONF_MAX_TASKS	10
 
+/* The number of task priority levels (2..32, 0 is the lowest priority
+   and is reserved for the idle task) */
+#define YAPOS_CONF_PRIO_LEVELS	8
+
+/* Stack size of the idle task (in 32-bit words) */
+#define YAPOS_CONF_IDLE_STACK_SIZE	64
+
+/* Suppress ticks while idle: SysTick is stretched up to the next timeout
+   and the idle task sleeps in WFI */
+#ifndef YAPOS_BENCH
+#define YAPOS_CONF_TICKLESS
+#endif
+
+/* Run tasks in privileged thread mode (the kernel benchmark reads the
+   cycle counter and SysTick from its tasks) */
+#ifdef YAPOS_BENCH
+#define YAPOS_CONF_PRIVILEGED_TASKS
+#endif
+
+/* Cooperative scheduling: the running task keeps the CPU until it blocks
+   or calls yapos_yield(), SysTick only keeps time and the tasks it (or an
+   interrupt) makes ready wait for that point, unless the idle task runs */
+// #define YAPOS_CONF_COOPERATIVE
+
+/* Place the kernel data accessed on every switch (tasks table, ready
+   lists, current/next task, idle task) and the stacks of the tasks defined
+   by YAPOS_TASK_DEFINE() in CCM SRAM, which DMA does not contend for (nor
+   reach: see YAPOS_TASK_DEFINE_SRAM()) */
+#define YAPOS_CONF_CCM
+
+/* Execute the kernel switch path (PendSV_Handler, SysTick_Handler and the
+   scheduler) and the functions marked YAPOS_CCMFUNC, e.g. hot interrupt
+   handlers, from CCM SRAM instead of flash with its wait states */
+#define YAPOS_CONF_CCMFUNC
+
+/* Write-protect the CCM SRAM pages holding that code (SYSCFG_RCR, until
+   reset) in yapos_init() */
+// #define YAPOS_CONF_CCMFUNC_LOCK
+
+/* Relocate the vector table to RAM (CCM SRAM with YAPOS_CONF_CCM) in
+   yapos_init(), for yapos_irq_attach(): number of device interrupts
+   (FPU_IRQn + 1 on the STM32F303) */
+#define YAPOS_CONF_IRQ_VECTORS	82
+
+/* Highest interrupt priority (lowest NVIC value) allowed to call the
+   kernel: the kernel critical sections and yapos_irq_lock() only mask up
+   to it (BASEPRI, ARMv7-M), higher priority interrupts are never delayed
+   but must not call the kernel. Supervisor calls run one level above it
+   (YAPOS_CONF_MAX_SYSCALL_PRIO-1, so that they are not masked inside a
+   critical section), hence it must be at least 1. All interrupts are
+   masked when not defined. */
+#define YAPOS_CONF_MAX_SYSCALL_PRIO	4
+
+/* NVIC priorities of SysTick and PendSV. PendSV must have the lowest
+   priority of all interrupts, SysTick may be raised up to
+   YAPOS_CONF_MAX_SYSCALL_PRIO. Both default to the lowest priority, so
+   that the tick does not delay the application interrupts. */
+#define YAPOS_CONF_SYSTICK_PRIO	15
+#define YAPOS_CONF_PENDSV_PRIO	15
+
+/* Default time slice (in ticks) of the tasks sharing a priority level:
+   the running task is preempted by its peers only once it has run that
+   long since it was dispatched (see struct yapos_task_attr). The kernel
+   benchmark measures the switch on every tick. */
+#ifndef YAPOS_BENCH
+#define YAPOS_CONF_TIME_SLICE	10
+#else
+#define YAPOS_CONF_TIME_SLICE	1
+#endif
+
+/* Fill task stacks with a pattern (see yapos_stack_unused()) and check the
+   stack of every task switched out, calling yapos_stack_overflow_hook() on
+   overflow */
+#define YAPOS_CONF_STACK_CHECK
+
+/* Per-task run time (DWT cycle counter) and context switch statistics */
+#define YAPOS_CONF_TASK_STATS
+
+/* Length of the run time statistics window (in ticks). Windows are
+   tumbling: the CPU shares are those of the last complete window, updated
+   once per window. */
+#define YAPOS_CONF_STATS_WINDOW	1000
+
+/* Per-task memory isolation with the MPU (ARMv7-M): every task can only
+   access its stack, the regions given to yapos_add_task_mpu() and read
+   (and execute) the code space. Task stacks must be sized to a power of
+   two (in bytes, at least 64) and aligned to their size. The kernel
+   objects and buffers a task passes to the kernel must lie in its stack
+   or data region (tasks sharing an object share a data region). */
+// #define YAPOS_CONF_MPU
+
 /* Enable debugging */
 #define YAPOS_CONF_DEBUG
 